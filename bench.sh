@@ -0,0 +1,151 @@
+#!/bin/sh
+# Ring formation benchmark for line.c.
+#
+# Runs a fixed set of scenarios (3, 4, 10, 100, 500 and 1000 bots in random,
+# line and pile formations, BENCH_SEEDS seeds each) through the swarm harness
+# (make line_harness) and writes one row per scenario, averaged over the
+# seeds, to $RESULTS:
+#
+#   nbots,formation,runs,ring_formed,steps_per_s,ticks_to_ring,ticks_all_coop,ticks_all_decided,msgs_per_bot
+#
+# ring_formed is the fraction of runs in which the harness saw the my_right
+# links close into one ring over all bots and hold for its convergence
+# window; ticks_to_ring averages the tick at which that ring first formed
+# over those runs only (-1 if none). ticks_all_* is the first tick at which
+# every bot was COOPERATIVE (resp. decided), averaged over the runs that got
+# there. steps_per_s is simulated kilo_ticks per wall-clock second. A run
+# stops early once its ring has held, so msgs_per_bot is counted up to then.
+#
+#   ./bench.sh            run the scenarios, write $RESULTS
+#   ./bench.sh save       run, then keep $RESULTS as the baseline $BASELINE
+#   ./bench.sh compare    run, then flag every metric that is more than TOL
+#                         percent worse than $BASELINE, or worse at all where
+#                         the baseline is 0 (exit status 1). steps_per_s is
+#                         only reported, as it depends on the machine.
+#
+# Set NO_RUN=1 to compare or save an existing $RESULTS without re-running.
+# The raw harness output of every run is kept under bench_runs/.
+
+BENCH_NBOTS=${BENCH_NBOTS:-"3 4 10 100 500 1000"}
+BENCH_FORMATIONS=${BENCH_FORMATIONS:-"random line pile"}
+BENCH_SEEDS=${BENCH_SEEDS:-"1 2 3"}
+BENCH_RATE=${BENCH_RATE:-0.8}
+BENCH_SIMTIME=${BENCH_SIMTIME:-600}
+BIN=${BIN:-./line_harness}
+BASE=${BASE:-kilombo.json}
+RESULTS=${RESULTS:-bench_results.csv}
+BASELINE=${BASELINE:-bench_baseline.csv}
+TOL=${TOL:-10}
+
+mode=${1:-run}
+case $mode in
+    run|save|compare) ;;
+    *) echo "usage: $0 [run|save|compare]" >&2; exit 2 ;;
+esac
+
+# Copy of the base config with one "key" : value pair replaced.
+set_param()
+{
+    sed "s/\(\"$1\"[[:space:]]*:[[:space:]]*\)[^,]*/\1$2/"
+}
+
+if [ -z "$NO_RUN" ]; then
+    if [ ! -x "$BIN" ]; then
+        echo "bench.sh: $BIN not found, build it with 'make line_harness'" >&2
+        exit 1
+    fi
+    mkdir -p bench_runs
+    set_param msgSuccessRate "$BENCH_RATE" < "$BASE" \
+        | set_param simulationTime "$BENCH_SIMTIME" > bench_runs/kilombo.json
+
+    echo "seed,nbots,formation,ticks_all_coop,ticks_all_decided,ticks_to_ring,steps_per_s,msgs_per_bot" > bench_runs.csv
+    for nbots in $BENCH_NBOTS; do
+        for formation in $BENCH_FORMATIONS; do
+            for seed in $BENCH_SEEDS; do
+                log=bench_runs/s${seed}_n${nbots}_${formation}.log
+                "$BIN" -c bench_runs/kilombo.json -n "$nbots" -f "$formation" -s "$seed" > "$log" || exit 1
+                # "... ticks/s, ..." on the first line, the milestones on the second
+                awk -v seed="$seed" -v n="$nbots" -v formation="$formation" '
+                    NR == 1 { for (i = 2; i <= NF; i++) if ($i == "ticks/s,") steps = $(i - 1) }
+                    NR == 2 {
+                        split($0, f, /(all cooperative at |, all decided at |, ring formed at |, | msgs\/bot)/)
+                        printf "%s,%s,%s,%d,%d,%d,%s,%s\n", seed, n, formation, f[2], f[3], f[4], steps, f[5]
+                    }' "$log" >> bench_runs.csv
+            done
+        done
+    done
+
+    awk -F, 'NR > 1 {
+            k = $2 "," $3
+            if (!(k in runs)) order[++nk] = k
+            runs[k]++
+            steps[k] += $7
+            msgs[k] += $8
+            if ($4 >= 0) { ncoop[k]++; coop[k] += $4 }
+            if ($5 >= 0) { ndec[k]++; dec[k] += $5 }
+            if ($6 >= 0) { nring[k]++; ring[k] += $6 }
+        }
+        END {
+            print "nbots,formation,runs,ring_formed,steps_per_s,ticks_to_ring,ticks_all_coop,ticks_all_decided,msgs_per_bot"
+            for (i = 1; i <= nk; i++) {
+                k = order[i]
+                printf "%s,%d,%.2f,%.0f,%.0f,%.0f,%.0f,%.1f\n", k, runs[k], nring[k] / runs[k],
+                       steps[k] / runs[k], nring[k] ? ring[k] / nring[k] : -1,
+                       ncoop[k] ? coop[k] / ncoop[k] : -1, ndec[k] ? dec[k] / ndec[k] : -1,
+                       msgs[k] / runs[k]
+            }
+        }' bench_runs.csv > "$RESULTS"
+fi
+
+column -s, -t < "$RESULTS" 2>/dev/null || cat "$RESULTS"
+
+case $mode in
+    save)
+        cp "$RESULTS" "$BASELINE"
+        echo "bench.sh: baseline saved to $BASELINE"
+        ;;
+    compare)
+        if [ ! -f "$BASELINE" ]; then
+            echo "bench.sh: no baseline $BASELINE, create one with '$0 save'" >&2
+            exit 2
+        fi
+        # higher is better for ring_formed, lower for the rest. A baseline of 0
+        # has nothing to scale by, so it must not get worse at all; -1 (never got
+        # there) cannot get worse. steps_per_s is wall-clock throughput of this
+        # machine, so it is shown but never counts as a regression.
+        awk -F, -v tol="$TOL" '
+            function worse(name, b, n, higher_better,    d) {
+                if (b < 0) {
+                    if (n >= 0) printf "IMPROVED %s %s: %s -> %s\n", key, name, b, n
+                    return
+                }
+                if (n < 0) d = tol + 1
+                else if (b == 0) d = (higher_better ? n < b : n > b) ? tol + 1 : 0
+                else d = (higher_better ? b - n : n - b) * 100 / b
+                if (d > tol) {
+                    printf "REGRESSION %s %s: %s -> %s\n", key, name, b, n
+                    bad++
+                }
+                else if (b == 0 && n != b)
+                    printf "IMPROVED %s %s: %s -> %s\n", key, name, b, n
+            }
+            FNR == 1 { next }
+            NR == FNR { base[$1 "," $2] = $0; next }
+            {
+                key = $1 " bots " $2
+                if (!(($1 "," $2) in base)) { printf "NEW %s\n", key; next }
+                split(base[$1 "," $2], b, ",")
+                worse("ring_formed", b[4], $4, 1)
+                if ($5 < b[5] * (1 - tol / 100))
+                    printf "NOTE %s steps_per_s: %s -> %s (wall clock, not checked)\n", key, b[5], $5
+                worse("ticks_to_ring", b[6], $6, 0)
+                worse("ticks_all_coop", b[7], $7, 0)
+                worse("ticks_all_decided", b[8], $8, 0)
+                worse("msgs_per_bot", b[9], $9, 0)
+            }
+            END {
+                if (bad) { printf "bench.sh: %d regression(s) beyond %s%%\n", bad, tol; exit 1 }
+                print "bench.sh: no regressions beyond " tol "%"
+            }' "$BASELINE" "$RESULTS"
+        ;;
+esac
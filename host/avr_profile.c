@@ -0,0 +1,196 @@
+/*
+ * Stub kilolib and synthetic radio traffic for profiling line.c on the AVR
+ * under simavr, see host/profile.c and "make profile".
+ *
+ * It is linked with line.c, built with the hex build's CFLAGS, in place of
+ * kilolib.a. kilo_start() runs setup(), then PROFILE_TICKS ticks of:
+ * PROFILE_RX_PER_TICK messages from PROFILE_NEIGHBORS made-up neighbors into
+ * message_rx(), one loop(), and message_tx() plus message_tx_success() when
+ * line.c has a message staged. Every handler call is bracketed by writes to
+ * GPIOR0 (see profile.h), so the simulator counts the cycles in between and
+ * the bot needs no timer. The traffic is the same on every run.
+ *
+ * The stack is painted with STACK_PAINT before main() runs. At the end the
+ * number of bytes below the top of RAM that were ever written is reported,
+ * and the CPU sleeps with interrupts off, which ends the simulation.
+ *
+ * estimate_distance() returns high_gain as is, and set_motors(), set_color()
+ * and rand_hard() touch no hardware, so kilolib's own costs are not in the
+ * numbers. message_crc() and rand_soft() work as in kilolib.
+ */
+#include <kilolib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/crc16.h>
+#include "line.h"
+#include "profile.h"
+
+#define PROFILE_TICKS 2000
+#define PROFILE_NEIGHBORS 12        // more than fit among the nearest, some join the ring
+#define PROFILE_RX_PER_TICK 2
+
+#define PROFILE(handler, call) do { GPIOR0 = (handler); call; GPIOR0 = 0; } while (0)
+
+extern USERDATA *mydata;
+#ifdef WIDE_IDS
+void put_field(uint8_t *payload, uint16_t field, uint16_t value);
+#endif
+void put_digest_dist(uint8_t *payload, uint8_t k, uint8_t step);
+
+// kilolib as seen by line.c
+volatile uint32_t kilo_ticks;
+uint16_t kilo_uid = 1;
+uint8_t kilo_turn_left = 70, kilo_turn_right = 70, kilo_straight_left = 70, kilo_straight_right = 70;
+message_t *(*kilo_message_tx)(void);
+void (*kilo_message_tx_success)(void);
+void (*kilo_message_rx)(message_t *, distance_measurement_t *);
+
+static uint8_t seed = 0xAA, accumulator;
+static uint16_t traffic = 1;        // generator of the synthetic messages
+static uint8_t token_round;
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+// Fills the stack with STACK_PAINT before the C runtime sets it up
+void paint_stack(void) __attribute__((naked, used, section(".init1")));
+void paint_stack(void)
+{
+    __asm volatile ("    ldi r30, lo8(_end)\n"
+                    "    ldi r31, hi8(_end)\n"
+                    "    ldi r24, %0\n"
+                    "    ldi r25, hi8(__stack)\n"
+                    "    rjmp 2f\n"
+                    "1:  st Z+, r24\n"
+                    "2:  cpi r30, lo8(__stack)\n"
+                    "    cpc r31, r25\n"
+                    "    brlo 1b\n"
+                    "    breq 1b\n" :: "M" (STACK_PAINT));
+}
+
+// Bytes from the top of RAM down to the deepest one that lost its paint
+static uint16_t stack_used(void)
+{
+    const uint8_t *p = &_end;
+
+    while (p <= &__stack && *p == STACK_PAINT)
+        p++;
+    return &__stack - p + 1;
+}
+
+void kilo_init(void) { }
+void rand_seed(uint8_t s) { seed = s; }
+uint8_t rand_hard(void) { return 0x5A; }
+uint8_t estimate_distance(const distance_measurement_t *d) { return d->high_gain; }
+void set_motors(uint8_t ccw, uint8_t cw) { (void) ccw; (void) cw; }
+void set_color(uint8_t color) { (void) color; }
+void delay(uint16_t ms) { (void) ms; }
+
+uint8_t rand_soft(void)
+{
+    seed ^= seed << 3;
+    seed ^= seed >> 5;
+    seed ^= accumulator++ >> 2;
+    return seed;
+}
+
+uint16_t message_crc(const message_t *msg)
+{
+    uint16_t crc = 0xFFFF;
+    uint8_t i;
+
+    for (i = 0; i < sizeof(msg->data); i++)
+        crc = _crc_ccitt_update(crc, msg->data[i]);
+    return _crc_ccitt_update(crc, msg->type);
+}
+
+static uint8_t next_random(void)
+{
+    traffic = traffic * 25173 + 13849;
+    return traffic >> 8;
+}
+
+// Made-up neighbor j, never the bot's own id
+static bot_id_t neighbor_id(uint8_t j)
+{
+    bot_id_t id = 101 + j;
+    return id == mydata->my_id ? id + PROFILE_NEIGHBORS : id;
+}
+
+/**
+ * Next synthetic message: mostly SHARE, some DIGEST, and JOIN, MOVE and ELECT
+ * addressed to the bot. Neighbor j claims j - 1 and j + 1 as its ring links.
+ **/
+static void make_message(message_t *msg, distance_measurement_t *d)
+{
+    uint8_t j = next_random() % PROFILE_NEIGHBORS, kind = next_random(), i;
+
+    for (i = 0; i < sizeof(msg->data); i++)
+        msg->data[i] = 0;
+    put_field(msg->data, ID, neighbor_id(j));
+    if (kind < 32)
+    {
+        put_field(msg->data, MSG, DIGEST);
+        for (i = 0; i < DIGEST_ENTRIES; i++)
+        {
+            put_field(msg->data, DIGEST_ID(i), neighbor_id((j + i + 1) % PROFILE_NEIGHBORS));
+            put_digest_dist(msg->data, i, next_random() & 0x0F);
+        }
+    }
+    else
+    {
+        put_field(msg->data, MSG, kind < 200 ? SHARE : kind < 216 ? JOIN : kind < 232 ? MOVE : ELECT);
+        put_field(msg->data, LEFT_ID, neighbor_id((j + PROFILE_NEIGHBORS - 1) % PROFILE_NEIGHBORS));
+        put_field(msg->data, STATE, j & 1 ? COOPERATIVE : AUTONOMOUS);
+        put_field(msg->data, EPOCH, 1);
+        put_field(msg->data, LEADER, neighbor_id(0));
+        if (kind < 200)
+        {
+            put_field(msg->data, RIGHT_ID, neighbor_id((j + 1) % PROFILE_NEIGHBORS));
+            put_field(msg->data, SHARE_INTERVAL, SHARING_TIME / SHARE_INTERVAL_UNIT);
+        }
+        else
+        {
+            put_field(msg->data, RIGHT_ID, mydata->my_id);
+            put_field(msg->data, RECEIVER, mydata->my_id);
+        }
+        put_field(msg->data, COLOR, kind >= 216 && kind < 232 ? ++token_round : COLOR_START << 4 | (j & 7));
+    }
+    msg->type = NORMAL;
+    msg->crc = message_crc(msg);
+    d->high_gain = d->low_gain = 30 + next_random() % 60;
+}
+
+void kilo_start(void (*setup)(void), void (*loop)(void))
+{
+    message_t msg, *tx;
+    distance_measurement_t d;
+    uint16_t used, t;
+    uint8_t k;
+
+    PROFILE(PROFILE_SETUP, setup());
+    for (t = 0; t < PROFILE_TICKS; t++)
+    {
+        kilo_ticks++;
+        for (k = 0; k < PROFILE_RX_PER_TICK; k++)
+        {
+            make_message(&msg, &d);
+            PROFILE(PROFILE_RX, kilo_message_rx(&msg, &d));
+        }
+        PROFILE(PROFILE_LOOP, loop());
+        PROFILE(PROFILE_TX, tx = kilo_message_tx());
+        if (tx)
+            PROFILE(PROFILE_TX_SUCCESS, kilo_message_tx_success());
+    }
+
+    used = stack_used();
+    GPIOR1 = used;
+    GPIOR2 = used >> 8;
+    GPIOR0 = PROFILE_DONE;
+    cli();
+    sleep_enable();
+    sleep_cpu();
+    for (;;)
+        ;
+}
@@ -0,0 +1,850 @@
+/*
+ * Headless swarm harness for line.c, without kilombo.
+ *
+ *   ./line_harness [-c kilombo.json] [-n bots] [-t ticks] [-s seed] [-j threads] [-f formation]
+ *                  [-m ideal|csma] [-o channel.csv] [-w window] [-S save.ckpt] [-R restore.ckpt]
+ *
+ * All bots' USERDATA live in one array. Every tick, each worker thread runs
+ * loop() and message_tx() for its share of the bots, then the messages are
+ * delivered through a grid of commsRadius cells, so a receiver only looks at
+ * senders in its own and the eight surrounding cells. Receivers pull their
+ * messages in a fixed order with their own random generator, so a run gives
+ * the same result with any number of threads.
+ *
+ * Every tick is one radio slot. The ideal channel (kilombo's model) drops
+ * each message with probability 1 - msgSuccessRate and nothing else. The
+ * csma channel also has contention: a bot only transmits if no bot within
+ * commsRadius did in the previous slot (carrier sense), otherwise it backs
+ * off a random number of idle slots below a contention window that doubles
+ * on every busy slot, from contentionWindow up to contentionWindowMax. A
+ * receiver gets a message only if exactly one bot in range sent in that slot
+ * and it did not send itself; two or more are a collision.
+ * message_tx_success() is called for every transmission, as on the bot,
+ * which has no acknowledgements.
+ *
+ * After every tick an observer checks whether the swarm has formed the ring:
+ * all bots COOPERATIVE and decided on the same leader_id, and following
+ * my_right from any bot visits every bot once, with my_left pointing back.
+ * The run stops once that ring has held, unchanged, for convergenceWindow
+ * ticks (0 runs to the end), and the tick it formed is reported, along with
+ * how many bots finished the ring coloring and how many my_right links join
+ * two bots of the same color, and how many bots still share their my_id.
+ *
+ * -S writes a binary checkpoint when the run ends: every bot's USERDATA
+ * (neighbor table, outbox, timers, election state and all), pose, motors,
+ * color and generators, and the ticks the run reached its milestones. -R
+ * starts from such a checkpoint instead of placing new bots and running
+ * setup(), with kilo_ticks and the milestones continuing from where it was
+ * written, for -t more ticks. Given -s as well, the generators are reseeded,
+ * so several experiments can fork from one formed ring. A checkpoint is
+ * only read back by a harness built from the same line.h.
+ *
+ * nBots, randSeed, formation (random, line or pile), simulationTime,
+ * commsRadius, msgSuccessRate, distanceNoise, speed, turnRate, channel,
+ * contentionWindow, contentionWindowMax and convergenceWindow are read from
+ * the config file (kilombo.json if present), the options override them.
+ * It prints the speed of the run, when every bot was COOPERATIVE and had
+ * decided on a leader, and the channel statistics; -o writes the per bot
+ * channel statistics as CSV.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define HOST_TOOL
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kilombo.h"
+#include "line.h"
+
+#define TICKS_PER_SECOND 32     // kilo_ticks per second on the real bot
+#define BOT_SPACING 40          // mm between bot centers in the line and pile formations
+#define MAX_THREADS 64
+#define MAX_WINDOW 128          // channel_t.window is 8 bits
+#define CHECKPOINT_MAGIC 0x504b434c     // "LCKP"
+#define CHECKPOINT_VERSION 2
+
+extern HOST_TLS USERDATA *mydata;
+void setup(void);
+void loop(void);
+message_t *message_tx(void);
+void message_tx_success(void);
+void message_rx(message_t *m, distance_measurement_t *d);
+
+typedef struct {
+    int nbots;
+    long ticks;
+    unsigned seed;
+    int threads;
+    char formation[16];
+    double comms_radius;        // mm
+    double msg_success_rate;
+    double distance_noise;      // mm, standard deviation
+    double speed;               // mm/s
+    double turn_rate;           // degrees/s
+    int csma;                   // channel model: 0 ideal, 1 csma
+    int window_min, window_max; // contention window bounds, in slots
+    long stable_window;         // ticks the ring must hold before the run stops, 0 never stops
+} config_t;
+
+typedef struct {
+    double x, y, heading;
+} pose_t;
+
+typedef struct {
+    uint32_t airtime;           // slots spent transmitting
+    uint32_t deferrals;         // slots a pending message waited for a busy channel or a backoff
+    uint32_t collisions;        // slots garbled by two or more senders in range
+    uint32_t received;          // messages delivered to this bot
+    uint8_t busy;               // a bot in range transmitted in the last slot
+    uint8_t backoff;            // idle slots to wait before the next attempt
+    uint8_t window;             // contention window of the next backoff
+} channel_t;
+
+// Checkpoint file header, followed by the per bot arrays in save_checkpoint() order
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t userdata_size;     // sizeof(USERDATA) of the harness that wrote it
+    uint32_t nbots;
+    uint32_t tick;              // kilo_ticks when it was written
+    int32_t coop_tick;          // milestones of the run so far, -1 if not reached
+    int32_t decided_tick;
+    int32_t ring_tick;          // tick the current ring formed, -1 if none
+    uint32_t ring;              // and its signature
+} checkpoint_t;
+
+// kilolib as seen by line.c
+uint32_t kilo_ticks;
+HOST_TLS uint16_t kilo_uid;
+uint8_t kilo_turn_left = 70, kilo_turn_right = 70, kilo_straight_left = 70, kilo_straight_right = 70;
+message_t *(*kilo_message_tx)(void);
+void (*kilo_message_tx_success)(void);
+void (*kilo_message_rx)(message_t *, distance_measurement_t *);
+
+static config_t config;
+static USERDATA *bots;              // USERDATA of bot i, kilo_uid i
+static pose_t *poses;
+static uint8_t (*motors)[2];        // last set_motors() of each bot
+static uint8_t *colors;
+static uint32_t *rand_state;        // rand_soft() of each bot
+static uint32_t *channel_state;     // message loss and distance noise seen by each receiver
+static message_t *outgoing;         // message each bot sent this tick, type 0 if none
+static channel_t *channels;
+static HOST_TLS int current;        // bot this thread is running
+
+// spatial grid, rebuilt every tick: the bots of cell c are cell_bots[cell_start[c] .. cell_start[c + 1])
+static int grid_w, grid_h;
+static double grid_x0, grid_y0;
+static int *cell_of, *cell_start, *cell_bots;
+static int grid_cells;
+
+static pthread_barrier_t barrier;
+static int stop;
+
+static uint32_t xorshift(uint32_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+/**
+ * Start state of generator stream (0 rand_soft, 1 channel) of bot i for the
+ * run seed: splitmix32 of both, so neighboring bots draw unrelated numbers
+ * from their first call on. Never 0, which xorshift would never leave.
+ **/
+static uint32_t bot_seed(uint32_t seed, int stream, int i)
+{
+    uint32_t x = seed * 2 + stream;
+    int k;
+
+    for (k = 0; k < 2; k++)
+    {
+        x += 0x9E3779B9u + (k ? (uint32_t) i : 0);
+        x = (x ^ (x >> 16)) * 0x85EBCA6Bu;
+        x = (x ^ (x >> 13)) * 0xC2B2AE35u;
+        x ^= x >> 16;
+    }
+    return x ? x : 1;
+}
+
+static double uniform(uint32_t *s)
+{
+    return xorshift(s) / 4294967296.0;
+}
+
+uint8_t rand_soft(void) { return xorshift(&rand_state[current]) >> 24; }
+uint8_t rand_hard(void) { return rand_soft(); }
+void rand_seed(uint8_t seed) { (void) seed; }
+uint8_t estimate_distance(const distance_measurement_t *d) { return d->high_gain; }
+void set_color(uint8_t color) { colors[current] = color; }
+void delay(uint16_t ms) { (void) ms; }
+uint16_t message_crc(const message_t *msg) { (void) msg; return 0; }
+void kilo_init(void) { }
+void kilo_start(void (*setup)(void), void (*loop)(void)) { (void) setup; (void) loop; }
+
+void set_motors(uint8_t ccw, uint8_t cw)
+{
+    motors[current][0] = ccw;
+    motors[current][1] = cw;
+}
+
+// Value of "key" in a flat JSON object, or value if it is not there
+static double config_number(const char *json, const char *key, double value)
+{
+    char pattern[64];
+    const char *p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if (json && (p = strstr(json, pattern)) && (p = strchr(p + strlen(pattern), ':')))
+        value = strtod(p + 1, 0);
+    return value;
+}
+
+static void config_string(const char *json, const char *key, char *value, size_t size)
+{
+    char pattern[64];
+    const char *p, *end;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    if (json && (p = strstr(json, pattern)) && (p = strchr(p + strlen(pattern), ':'))
+        && (p = strchr(p, '"')) && (end = strchr(p + 1, '"')) && (size_t) (end - p - 1) < size)
+    {
+        memcpy(value, p + 1, end - p - 1);
+        value[end - p - 1] = 0;
+    }
+}
+
+static char *read_file(const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    char *text;
+    long size;
+
+    if (!f)
+        return 0;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    text = malloc(size + 1);
+    if (!text || fread(text, 1, size, f) != (size_t) size)
+    {
+        fprintf(stderr, "harness: cannot read %s\n", name);
+        exit(1);
+    }
+    text[size] = 0;
+    fclose(f);
+    return text;
+}
+
+static void load_config(const char *name, int required)
+{
+    char *json = read_file(name), channel[8];
+
+    if (!json && required)
+    {
+        perror(name);
+        exit(1);
+    }
+    config.nbots = config_number(json, "nBots", 100);
+    config.seed = config_number(json, "randSeed", 1);
+    config.ticks = config_number(json, "simulationTime", 0) * TICKS_PER_SECOND;
+    config.comms_radius = config_number(json, "commsRadius", 100);
+    config.msg_success_rate = config_number(json, "msgSuccessRate", 0.8);
+    config.distance_noise = config_number(json, "distanceNoise", 2);
+    config.speed = config_number(json, "speed", 7);
+    config.turn_rate = config_number(json, "turnRate", 22);
+    config.window_min = config_number(json, "contentionWindow", 4);
+    config.window_max = config_number(json, "contentionWindowMax", 64);
+    config.stable_window = config_number(json, "convergenceWindow", 5 * TICKS_PER_SECOND);
+    strcpy(config.formation, "random");
+    config_string(json, "formation", config.formation, sizeof(config.formation));
+    strcpy(channel, "ideal");
+    config_string(json, "channel", channel, sizeof(channel));
+    config.csma = !strcmp(channel, "csma");
+    if (config.ticks <= 0)
+        config.ticks = 300 * TICKS_PER_SECOND;
+    free(json);
+}
+
+static void place_bots(uint32_t *s)
+{
+    int i, row = (int) ceil(sqrt(config.nbots));
+
+    for (i = 0; i < config.nbots; i++)
+    {
+        if (!strcmp(config.formation, "line"))
+        {
+            poses[i].x = i * BOT_SPACING;
+            poses[i].y = 0;
+        }
+        else if (!strcmp(config.formation, "pile"))
+        {
+            // hexagonal packing, every other row shifted by half a bot
+            poses[i].x = (i % row + (i / row % 2) * 0.5) * BOT_SPACING;
+            poses[i].y = i / row * BOT_SPACING * 0.866;
+        }
+        else
+        {
+            // uniform over the square a pile would fill
+            poses[i].x = uniform(s) * row * BOT_SPACING;
+            poses[i].y = uniform(s) * row * BOT_SPACING;
+        }
+        poses[i].heading = uniform(s) * 2 * M_PI;
+    }
+}
+
+// Counting sort of the bots into commsRadius cells
+static void build_grid(void)
+{
+    double x1 = poses[0].x, y1 = poses[0].y;
+    int i, c;
+
+    grid_x0 = x1;
+    grid_y0 = y1;
+    for (i = 1; i < config.nbots; i++)
+    {
+        grid_x0 = fmin(grid_x0, poses[i].x);
+        grid_y0 = fmin(grid_y0, poses[i].y);
+        x1 = fmax(x1, poses[i].x);
+        y1 = fmax(y1, poses[i].y);
+    }
+    grid_w = (int) ((x1 - grid_x0) / config.comms_radius) + 1;
+    grid_h = (int) ((y1 - grid_y0) / config.comms_radius) + 1;
+    if (grid_w * grid_h > grid_cells)
+    {
+        grid_cells = grid_w * grid_h;
+        cell_start = realloc(cell_start, (grid_cells + 1) * sizeof(int));
+        if (!cell_start)
+        {
+            fprintf(stderr, "harness: out of memory\n");
+            exit(1);
+        }
+    }
+
+    memset(cell_start, 0, (grid_w * grid_h + 1) * sizeof(int));
+    for (i = 0; i < config.nbots; i++)
+    {
+        cell_of[i] = (int) ((poses[i].y - grid_y0) / config.comms_radius) * grid_w
+                   + (int) ((poses[i].x - grid_x0) / config.comms_radius);
+        cell_start[cell_of[i] + 1]++;
+    }
+    for (c = 0; c < grid_w * grid_h; c++)
+        cell_start[c + 1] += cell_start[c];
+    // cell_start[c + 1] is the end of cell c, fill it backwards to its start and shift down
+    for (i = config.nbots - 1; i >= 0; i--)
+        cell_bots[--cell_start[cell_of[i] + 1]] = i;
+    for (c = 0; c < grid_w * grid_h; c++)
+        cell_start[c] = cell_start[c + 1];
+    cell_start[grid_w * grid_h] = config.nbots;
+}
+
+// Carrier sense with binary exponential backoff: may bot i send its pending message in this slot?
+static int channel_access(int i)
+{
+    channel_t *ch = &channels[i];
+
+    if (!config.csma)
+        return 1;
+    if (ch->busy)
+    {
+        ch->deferrals++;
+        if (!ch->backoff)
+        {
+            ch->backoff = 1 + xorshift(&channel_state[i]) % ch->window;
+            ch->window = ch->window * 2 < config.window_max ? ch->window * 2 : config.window_max;
+        }
+        return 0;
+    }
+    if (ch->backoff)
+    {
+        ch->deferrals++;
+        ch->backoff--;
+        return 0;
+    }
+    ch->window = config.window_min;
+    return 1;
+}
+
+static void run_bot(int i)
+{
+    message_t *m;
+    double dt = 1.0 / TICKS_PER_SECOND;
+
+    current = i;
+    kilo_uid = i;
+    mydata = &bots[i];
+    loop();
+
+    outgoing[i].type = 0;
+    m = message_tx();
+    if (m && channel_access(i))
+    {
+        outgoing[i] = *m;
+        message_tx_success();
+        channels[i].airtime++;
+    }
+
+    // both motors drive straight, one alone turns towards the other side
+    if (motors[i][0] && motors[i][1])
+    {
+        poses[i].x += cos(poses[i].heading) * config.speed * dt;
+        poses[i].y += sin(poses[i].heading) * config.speed * dt;
+    }
+    else if (motors[i][0])
+        poses[i].heading += config.turn_rate * M_PI / 180 * dt;
+    else if (motors[i][1])
+        poses[i].heading -= config.turn_rate * M_PI / 180 * dt;
+}
+
+// Delivers the message of sender i, d2 mm² away, to receiver j unless it is lost
+static void deliver(int j, int i, double d2)
+{
+    distance_measurement_t dm;
+    double d, noise;
+
+    if (uniform(&channel_state[j]) >= config.msg_success_rate)
+        return;
+    // roughly normal noise: four uniforms have variance 1/3
+    noise = (uniform(&channel_state[j]) + uniform(&channel_state[j]) + uniform(&channel_state[j])
+             + uniform(&channel_state[j]) - 2) * sqrt(3) * config.distance_noise;
+    d = sqrt(d2) + noise;
+    dm.low_gain = dm.high_gain = d < 0 ? 0 : d > 255 ? 255 : (int16_t) (d + 0.5);
+    channels[j].received++;
+    message_rx(&outgoing[i], &dm);
+}
+
+// Delivers the messages sent this tick within commsRadius of receiver j
+static void receive(int j)
+{
+    int cx = cell_of[j] % grid_w, cy = cell_of[j] / grid_w, x, y, k, senders = 0, sender = 0;
+    double r2 = config.comms_radius * config.comms_radius, sender_d2 = 0;
+
+    current = j;
+    kilo_uid = j;
+    mydata = &bots[j];
+    for (y = cy - 1; y <= cy + 1; y++)
+        for (x = cx - 1; x <= cx + 1; x++)
+        {
+            int c = y * grid_w + x;
+
+            if (x < 0 || y < 0 || x >= grid_w || y >= grid_h)
+                continue;
+            for (k = cell_start[c]; k < cell_start[c + 1]; k++)
+            {
+                int i = cell_bots[k];
+                double dx = poses[i].x - poses[j].x, dy = poses[i].y - poses[j].y, d2 = dx * dx + dy * dy;
+
+                if (i == j || outgoing[i].type != NORMAL || d2 > r2)
+                    continue;
+                if (!config.csma)
+                    deliver(j, i, d2);
+                senders++;
+                sender = i;
+                sender_d2 = d2;
+            }
+        }
+
+    if (!config.csma)
+        return;
+    channels[j].busy = senders > 0;
+    if (outgoing[j].type == NORMAL)
+        return;                 // it was sending itself
+    if (senders > 1)
+        channels[j].collisions++;
+    else if (senders == 1)
+        deliver(j, sender, sender_d2);
+}
+
+/*
+ * Has the swarm formed the ring? Every bot COOPERATIVE and decided on the
+ * same leader, and the my_right links one cycle through all bots with my_left
+ * the other way round. *signature identifies the ring, to tell when it changes.
+ */
+static int ring_formed(uint32_t *signature)
+{
+    static int slot_of[ID_MASK + 1];
+    int i, k;
+    uint32_t h = 2166136261u;
+
+    memset(slot_of, -1, sizeof(slot_of));
+    for (i = 0; i < config.nbots; i++)
+    {
+        if (bots[i].state != COOPERATIVE || !bots[i].has_decided || bots[i].leader_id != bots[0].leader_id
+            || slot_of[bots[i].my_id] >= 0)
+            return 0;
+        slot_of[bots[i].my_id] = i;
+    }
+    for (i = 0, k = 0; k < config.nbots; k++)
+    {
+        int right = slot_of[bots[i].my_right];
+
+        if (right < 0 || bots[right].my_left != bots[i].my_id || (right == 0 && k < config.nbots - 1))
+            return 0;
+        h = (h ^ bots[i].my_id) * 16777619u;
+        i = right;
+    }
+    *signature = (h ^ bots[0].leader_id) * 16777619u;
+    return i == 0;
+}
+
+// Bots [*lo, *hi) belong to thread t
+static void thread_bots(int t, int *lo, int *hi)
+{
+    *lo = (long) config.nbots * t / config.threads;
+    *hi = (long) config.nbots * (t + 1) / config.threads;
+}
+
+static void *worker(void *arg)
+{
+    int lo, hi, i;
+
+    thread_bots((int) (long) arg, &lo, &hi);
+
+    for (;;)
+    {
+        pthread_barrier_wait(&barrier);         // tick started
+        if (stop)
+            return 0;
+        for (i = lo; i < hi; i++)
+            run_bot(i);
+        pthread_barrier_wait(&barrier);         // grid built
+        pthread_barrier_wait(&barrier);
+        for (i = lo; i < hi; i++)
+            receive(i);
+        pthread_barrier_wait(&barrier);         // tick done
+    }
+}
+
+static double wall_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *allocate(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+
+    if (!p)
+    {
+        fprintf(stderr, "harness: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void allocate_bots(void)
+{
+    bots = allocate(config.nbots, sizeof(USERDATA));
+    poses = allocate(config.nbots, sizeof(pose_t));
+    motors = allocate(config.nbots, sizeof(*motors));
+    colors = allocate(config.nbots, 1);
+    rand_state = allocate(config.nbots, sizeof(uint32_t));
+    channel_state = allocate(config.nbots, sizeof(uint32_t));
+    outgoing = allocate(config.nbots, sizeof(message_t));
+    channels = allocate(config.nbots, sizeof(channel_t));
+    cell_of = allocate(config.nbots, sizeof(int));
+    cell_bots = allocate(config.nbots, sizeof(int));
+}
+
+// Reads or writes the per bot arrays of a checkpoint, returns 0 on a short read or write
+static int checkpoint_arrays(FILE *f, int save)
+{
+    struct { void *data; size_t size; } arrays[] = {
+        { bots, sizeof(USERDATA) }, { poses, sizeof(pose_t) }, { motors, sizeof(*motors) },
+        { colors, 1 }, { rand_state, sizeof(uint32_t) }, { channel_state, sizeof(uint32_t) },
+        { channels, sizeof(channel_t) }
+    };
+    size_t a, n = config.nbots;
+
+    for (a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++)
+        if ((save ? fwrite(arrays[a].data, arrays[a].size, n, f) : fread(arrays[a].data, arrays[a].size, n, f)) != n)
+            return 0;
+    return 1;
+}
+
+static void save_checkpoint(const char *name, long coop_tick, long decided_tick, long ring_tick, uint32_t ring)
+{
+    checkpoint_t header = { CHECKPOINT_MAGIC, CHECKPOINT_VERSION, sizeof(USERDATA), config.nbots, kilo_ticks,
+                            coop_tick, decided_tick, ring_tick, ring };
+    FILE *f = fopen(name, "wb");
+
+    if (!f || fwrite(&header, sizeof(header), 1, f) != 1 || !checkpoint_arrays(f, 1) || fclose(f))
+    {
+        perror(name);
+        exit(1);
+    }
+}
+
+// Allocates the bots of checkpoint name and loads them and the milestones, returns its kilo_ticks
+static uint32_t load_checkpoint(const char *name, long *coop_tick, long *decided_tick, long *ring_tick, uint32_t *ring)
+{
+    checkpoint_t header;
+    FILE *f = fopen(name, "rb");
+
+    if (!f)
+    {
+        perror(name);
+        exit(1);
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != CHECKPOINT_MAGIC
+        || header.version != CHECKPOINT_VERSION || header.nbots < 1 || header.nbots > 65535)
+    {
+        fprintf(stderr, "harness: %s is not a checkpoint\n", name);
+        exit(1);
+    }
+    if (header.userdata_size != sizeof(USERDATA))
+    {
+        fprintf(stderr, "harness: %s holds %u byte USERDATA, this build has %u\n",
+                name, (unsigned) header.userdata_size, (unsigned) sizeof(USERDATA));
+        exit(1);
+    }
+    config.nbots = header.nbots;
+    allocate_bots();
+    if (!checkpoint_arrays(f, 0))
+    {
+        fprintf(stderr, "harness: %s is truncated\n", name);
+        exit(1);
+    }
+    fclose(f);
+    *coop_tick = header.coop_tick;
+    *decided_tick = header.decided_tick;
+    *ring_tick = header.ring_tick;
+    *ring = header.ring;
+    return header.tick;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: line_harness [-c kilombo.json] [-n bots] [-t ticks] [-s seed] [-j threads] [-f formation]\n"
+                    "                    [-m ideal|csma] [-o channel.csv] [-w window] [-S save.ckpt] [-R restore.ckpt]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t threads[MAX_THREADS];
+    long coop_tick = -1, decided_tick = -1, ring_tick = -1, ticks, tx = 0, dropped = 0;
+    uint32_t ring = 0, signature;
+    channel_t total = { 0 };
+    const char *channel_file = 0, *save_file = 0, *restore_file = 0;
+    uint32_t first_tick = 0;
+    int reseed = 0;
+    uint32_t place_state;
+    double start, seconds;
+    int i, t;
+
+    // the config file comes first so the other options override it
+    for (i = 1; i + 1 < argc && strcmp(argv[i], "-c"); i++)
+        ;
+    load_config(i + 1 < argc ? argv[i + 1] : "kilombo.json", i + 1 < argc);
+    config.threads = 1;
+    for (i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (!strcmp(argv[i], "-c"))
+            ;
+        else if (!strcmp(argv[i], "-n"))
+            config.nbots = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-t"))
+            config.ticks = atol(argv[i + 1]);
+        else if (!strcmp(argv[i], "-s"))
+        {
+            config.seed = atoi(argv[i + 1]);
+            reseed = 1;
+        }
+        else if (!strcmp(argv[i], "-j"))
+            config.threads = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i], "-f"))
+            snprintf(config.formation, sizeof(config.formation), "%s", argv[i + 1]);
+        else if (!strcmp(argv[i], "-m") && (!strcmp(argv[i + 1], "ideal") || !strcmp(argv[i + 1], "csma")))
+            config.csma = !strcmp(argv[i + 1], "csma");
+        else if (!strcmp(argv[i], "-o"))
+            channel_file = argv[i + 1];
+        else if (!strcmp(argv[i], "-w"))
+            config.stable_window = atol(argv[i + 1]);
+        else if (!strcmp(argv[i], "-S"))
+            save_file = argv[i + 1];
+        else if (!strcmp(argv[i], "-R"))
+            restore_file = argv[i + 1];
+        else
+            usage();
+        i++;
+    }
+    if (config.nbots < 1 || config.nbots > 65535 || config.threads < 1 || config.threads > MAX_THREADS)
+        usage();
+    if (config.window_min < 1 || config.window_max < config.window_min || config.window_max > MAX_WINDOW)
+    {
+        fprintf(stderr, "harness: need 1 <= contentionWindow <= contentionWindowMax <= %d\n", MAX_WINDOW);
+        exit(2);
+    }
+
+    if (restore_file)
+    {
+        first_tick = load_checkpoint(restore_file, &coop_tick, &decided_tick, &ring_tick, &ring);
+        for (i = 0; reseed && i < config.nbots; i++)
+        {
+            rand_state[i] = bot_seed(config.seed ^ rand_state[i], 0, i);
+            channel_state[i] = bot_seed(config.seed ^ channel_state[i], 1, i);
+        }
+    }
+    else
+    {
+        allocate_bots();
+        place_state = config.seed * 2654435761u + 1;
+        place_bots(&place_state);
+    }
+    if (config.threads > config.nbots)
+        config.threads = config.nbots;
+
+    for (i = 0; !restore_file && i < config.nbots; i++)
+    {
+        rand_state[i] = bot_seed(config.seed, 0, i);
+        channel_state[i] = bot_seed(config.seed, 1, i);
+        channels[i].window = config.window_min;
+        current = i;
+        kilo_uid = i;
+        mydata = &bots[i];
+        setup();
+    }
+
+    pthread_barrier_init(&barrier, 0, config.threads);
+    for (t = 1; t < config.threads; t++)
+        pthread_create(&threads[t], 0, worker, (void *) (long) t);
+
+    start = wall_clock();
+    for (ticks = 1; ticks <= config.ticks; ticks++)
+    {
+        int ncoop = 0, ndecided = 0, lo, hi;
+
+        kilo_ticks = first_tick + ticks;
+        thread_bots(0, &lo, &hi);
+        pthread_barrier_wait(&barrier);
+        for (i = lo; i < hi; i++)
+            run_bot(i);
+        pthread_barrier_wait(&barrier);
+        build_grid();
+        pthread_barrier_wait(&barrier);
+        for (i = lo; i < hi; i++)
+            receive(i);
+        pthread_barrier_wait(&barrier);
+
+        for (i = 0; i < config.nbots; i++)
+        {
+            ncoop += bots[i].state == COOPERATIVE;
+            ndecided += bots[i].has_decided;
+        }
+        if (ncoop == config.nbots && coop_tick < 0)
+            coop_tick = kilo_ticks;
+        if (ndecided == config.nbots && decided_tick < 0)
+            decided_tick = kilo_ticks;
+
+        if (!ring_formed(&signature))
+            ring_tick = -1;
+        else if (ring_tick < 0 || signature != ring)
+        {
+            ring_tick = kilo_ticks;
+            ring = signature;
+        }
+        else if (config.stable_window && kilo_ticks - ring_tick >= config.stable_window)
+            break;
+    }
+    if (ticks > config.ticks)
+        ticks = config.ticks;
+    kilo_ticks = first_tick + ticks;
+    seconds = wall_clock() - start;
+
+    stop = 1;
+    pthread_barrier_wait(&barrier);
+    for (t = 1; t < config.threads; t++)
+        pthread_join(threads[t], 0);
+
+    for (i = 0; i < config.nbots; i++)
+    {
+        for (t = SHARE; t < NUM_MSG_TYPES; t++)
+            tx += bots[i].stats.tx[t];
+        dropped += bots[i].stats.rx_dropped;
+    }
+
+    printf("harness: %d bots (%s), %ld ticks, %d threads: %.3f s, %.0f ticks/s, %.2f M bot-ticks/s\n",
+           config.nbots, config.formation, ticks, config.threads, seconds,
+           ticks / seconds, ticks * (double) config.nbots / seconds / 1e6);
+    printf("harness: all cooperative at %ld, all decided at %ld, ring formed at %ld%s, %.1f msgs/bot, %ld dropped by full receive rings\n",
+           coop_tick, decided_tick, ring_tick, ticks < config.ticks ? " (stopped early)" : "",
+           (double) tx / config.nbots, dropped);
+    for (i = 0; i < config.nbots; i++)
+        if (bots[i].is_leader)
+            printf("harness: leader %d: token round %d, round trip %u ticks, %lu tokens regenerated\n",
+                   i, bots[i].token_round, bots[i].token_rtt, (unsigned long) bots[i].stats.tokens_regenerated);
+    {
+        int done = 0, clashes = 0, k;
+
+        for (i = 0; i < config.nbots; i++)
+        {
+            done += bots[i].round_counter == COLOR_DONE;
+            for (k = 0; k < config.nbots; k++)
+                clashes += k != i && bots[k].my_id == bots[i].my_right && bots[i].my_right != bots[i].my_id
+                           && bots[k].color_id == bots[i].color_id;
+        }
+        printf("harness: %d of %d bots colored, %d my_right links with the same color\n", done, config.nbots, clashes);
+    }
+    {
+        static int holders[ID_MASK + 1];
+        unsigned long redrawn = 0;
+        int shared = 0;
+
+        for (i = 0; i < config.nbots; i++)
+        {
+            holders[bots[i].my_id]++;
+            redrawn += bots[i].stats.ids_redrawn;
+        }
+        for (i = 0; i < config.nbots; i++)
+            shared += holders[bots[i].my_id] > 1;
+        printf("harness: %d bots share their my_id with another, %lu ids redrawn\n", shared, redrawn);
+    }
+
+    for (i = 0; i < config.nbots; i++)
+    {
+        total.airtime += channels[i].airtime;
+        total.deferrals += channels[i].deferrals;
+        total.collisions += channels[i].collisions;
+        total.received += channels[i].received;
+    }
+    printf("harness: %s channel: %.2f%% airtime, %.1f deferrals/bot, %.1f collisions/bot, %.2f receptions/transmission\n",
+           config.csma ? "csma" : "ideal", 100.0 * total.airtime / config.nbots / kilo_ticks,
+           (double) total.deferrals / config.nbots, (double) total.collisions / config.nbots,
+           total.airtime ? (double) total.received / total.airtime : 0.0);
+
+    if (channel_file)
+    {
+        FILE *f = fopen(channel_file, "w");
+
+        if (!f)
+        {
+            perror(channel_file);
+            exit(1);
+        }
+        fprintf(f, "uid,airtime,deferrals,collisions,received\n");
+        for (i = 0; i < config.nbots; i++)
+            fprintf(f, "%d,%lu,%lu,%lu,%lu\n", i, (unsigned long) channels[i].airtime,
+                    (unsigned long) channels[i].deferrals, (unsigned long) channels[i].collisions,
+                    (unsigned long) channels[i].received);
+        fclose(f);
+    }
+
+    if (save_file)
+    {
+        save_checkpoint(save_file, coop_tick, decided_tick, ring_tick, ring);
+        printf("harness: checkpoint of %d bots at tick %lu written to %s\n",
+               config.nbots, (unsigned long) kilo_ticks, save_file);
+    }
+    return 0;
+}
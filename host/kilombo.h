@@ -0,0 +1,74 @@
+/*
+ * Stand-in for the kilombo header used by the host tools in this directory
+ * (replay.c, harness.c). It declares the kilolib calls line.c makes, the tools define
+ * them, and line.c is compiled with -Ihost so this file is found instead
+ * of the simulator's. HOST leaves out the jansson state callback.
+ */
+#ifndef HOST_KILOMBO_H
+#define HOST_KILOMBO_H
+
+#include <stdint.h>
+
+#define HOST
+
+// per thread copies of what kilombo switches between bots, so tools can run bots in parallel
+#define HOST_TLS __thread
+
+typedef enum {
+    NORMAL = 1,
+    GPS,
+    SPECIAL = 0x80,
+    BOOT = 0x80,
+    BOOTPGM_PAGE,
+    BOOTPGM_SIZE,
+    RESET,
+    SLEEP,
+    WAKEUP,
+    CHARGE,
+    VOLTAGE,
+    RUNNING,
+    READUID,
+    CALIB
+} message_type_t;
+
+typedef struct {
+    uint8_t data[9];
+    message_type_t type;
+    uint16_t crc;
+} message_t;
+
+typedef struct {
+    int16_t low_gain;
+    int16_t high_gain;
+} distance_measurement_t;
+
+#define RGB(r, g, b) (((r) & 3) | (((g) & 3) << 2) | (((b) & 3) << 4))
+
+extern uint32_t kilo_ticks;
+extern HOST_TLS uint16_t kilo_uid;
+extern uint8_t kilo_turn_left, kilo_turn_right, kilo_straight_left, kilo_straight_right;
+extern message_t *(*kilo_message_tx)(void);
+extern void (*kilo_message_tx_success)(void);
+extern void (*kilo_message_rx)(message_t *, distance_measurement_t *);
+
+void kilo_init(void);
+void kilo_start(void (*setup)(void), void (*loop)(void));
+uint8_t estimate_distance(const distance_measurement_t *d);
+uint8_t rand_soft(void);
+uint8_t rand_hard(void);
+void rand_seed(uint8_t seed);
+void set_motors(uint8_t ccw, uint8_t cw);
+void set_color(uint8_t color);
+void delay(uint16_t ms);
+uint16_t message_crc(const message_t *msg);
+
+// line.c's USERDATA pointer; the tool points it at the bot being run
+#define REGISTER_USERDATA(type) HOST_TLS type *mydata;
+#define SET_CALLBACK(name, fn)
+
+// line.c's main() is the bot program, not the tool's
+#ifndef HOST_TOOL
+#define main kilobot_main
+#endif
+
+#endif
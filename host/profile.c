@@ -0,0 +1,221 @@
+/*
+ * Cycle profile of line.c on the simulated ATmega328p.
+ *
+ *   ./line_profile [-o profile.csv] [-b baseline.csv [-t percent]] line_profile.elf
+ *
+ * Runs the profiling build of line.c (host/avr_profile.c, make line_profile.elf)
+ * under simavr at 8 MHz and times every handler call from the GPIOR0 markers
+ * in profile.h. It prints the calls, average and worst case cycles of setup(),
+ * loop(), message_rx(), message_tx() and message_tx_success(), the worst of
+ * the three that run in an ISR on the bot, and the stack high-water mark.
+ *
+ *   -o file     also write the numbers as metric,value lines
+ *   -b file     compare against such a file, flag every metric more than
+ *               -t percent (default 5) above it and exit 1 if any is
+ *
+ * The traffic and the simulation are deterministic, so any change in the
+ * numbers comes from the code.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include "profile.h"
+
+#define PROFILE_FREQUENCY 8000000
+#define MAX_METRICS 32
+
+typedef struct {
+    unsigned long calls;
+    avr_cycle_count_t total;
+    avr_cycle_count_t max;
+} handler_profile_t;
+
+typedef struct {
+    char name[48];
+    double value;
+} metric_t;
+
+static const char *handler_names[PROFILE_HANDLERS] = {
+    "", "setup", "loop", "message_rx", "message_tx", "message_tx_success"
+};
+static const int in_isr[PROFILE_HANDLERS] = { 0, 0, 0, 1, 1, 1 };
+
+static handler_profile_t handlers[PROFILE_HANDLERS];
+static int current;                 // handler being run, 0 if none
+static avr_cycle_count_t entered;   // cycle count when it was entered
+static int done;
+static unsigned stack_low, stack_high;
+
+static metric_t metrics[MAX_METRICS];
+static int num_metrics;
+
+static void marker_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+    (void) param;
+    if (addr == GPIOR1_ADDR)
+        stack_low = v;
+    else if (addr == GPIOR2_ADDR)
+        stack_high = v;
+    else if (v == PROFILE_DONE)
+        done = 1;
+    else if (v > 0 && v < PROFILE_HANDLERS)
+    {
+        current = v;
+        entered = avr->cycle;
+    }
+    else if (v == 0 && current)
+    {
+        avr_cycle_count_t cycles = avr->cycle - entered;
+
+        handlers[current].calls++;
+        handlers[current].total += cycles;
+        if (cycles > handlers[current].max)
+            handlers[current].max = cycles;
+        current = 0;
+    }
+}
+
+static void add_metric(const char *name, double value)
+{
+    if (num_metrics == MAX_METRICS)
+        return;
+    snprintf(metrics[num_metrics].name, sizeof(metrics[num_metrics].name), "%s", name);
+    metrics[num_metrics++].value = value;
+}
+
+static void save_metrics(const char *name)
+{
+    FILE *f = fopen(name, "w");
+    int i;
+
+    if (!f)
+    {
+        perror(name);
+        exit(1);
+    }
+    fprintf(f, "metric,value\n");
+    for (i = 0; i < num_metrics; i++)
+        fprintf(f, "%s,%.0f\n", metrics[i].name, metrics[i].value);
+    fclose(f);
+}
+
+// Returns the number of metrics more than tolerance percent above the baseline
+static int compare_metrics(const char *name, double tolerance)
+{
+    FILE *f = fopen(name, "r");
+    char line[128], metric[48];
+    double base;
+    int i, worse = 0;
+
+    if (!f)
+    {
+        perror(name);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%47[^,],%lf", metric, &base) != 2)
+            continue;           // the header
+        for (i = 0; i < num_metrics && strcmp(metrics[i].name, metric); i++)
+            ;
+        if (i == num_metrics)
+            continue;
+        if (metrics[i].value > base * (1 + tolerance / 100))
+        {
+            printf("profile: REGRESSION %s %.0f, baseline %.0f (+%.1f%%)\n", metric, metrics[i].value, base,
+                   base > 0 ? 100 * (metrics[i].value - base) / base : 100.0);
+            worse++;
+        }
+    }
+    fclose(f);
+    if (!worse)
+        printf("profile: no metric more than %.1f%% above %s\n", tolerance, name);
+    return worse;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: line_profile [-o profile.csv] [-b baseline.csv [-t percent]] line_profile.elf\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = 0, *baseline = 0;
+    double tolerance = 5;
+    elf_firmware_t firmware;
+    avr_t *avr;
+    char name[48];
+    int i, state = cpu_Running, worst_isr = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            tolerance = atof(argv[++i]);
+        else
+            usage();
+    }
+    if (i != argc - 1)
+        usage();
+
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(argv[i], &firmware))
+    {
+        fprintf(stderr, "profile: cannot read %s\n", argv[i]);
+        return 1;
+    }
+    avr = avr_make_mcu_by_name("atmega328p");
+    if (!avr)
+    {
+        fprintf(stderr, "profile: simavr has no atmega328p\n");
+        return 1;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    avr->frequency = PROFILE_FREQUENCY;
+    avr_register_io_write(avr, GPIOR0_ADDR, marker_write, 0);
+    avr_register_io_write(avr, GPIOR1_ADDR, marker_write, 0);
+    avr_register_io_write(avr, GPIOR2_ADDR, marker_write, 0);
+
+    while (!done && state != cpu_Done && state != cpu_Crashed)
+        state = avr_run(avr);
+    if (!done)
+    {
+        fprintf(stderr, "profile: %s stopped before the end of the run\n", argv[i]);
+        return 1;
+    }
+
+    printf("profile: %-20s %8s %10s %10s %10s\n", "handler", "calls", "avg cyc", "max cyc", "max us");
+    for (i = 1; i < PROFILE_HANDLERS; i++)
+    {
+        handler_profile_t *h = &handlers[i];
+        double avg = h->calls ? (double) h->total / h->calls : 0;
+
+        printf("profile: %-20s %8lu %10.0f %10llu %10.1f%s\n", handler_names[i], h->calls, avg,
+               (unsigned long long) h->max, h->max * 1e6 / PROFILE_FREQUENCY, in_isr[i] ? "  (ISR)" : "");
+        snprintf(name, sizeof(name), "%s_avg_cycles", handler_names[i]);
+        add_metric(name, avg);
+        snprintf(name, sizeof(name), "%s_max_cycles", handler_names[i]);
+        add_metric(name, h->max);
+        if (in_isr[i] && h->max > handlers[worst_isr].max)
+            worst_isr = i;
+    }
+    printf("profile: worst ISR-context handler %s, %llu cycles (%.1f us)\n", worst_isr ? handler_names[worst_isr] : "none",
+           (unsigned long long) handlers[worst_isr].max, handlers[worst_isr].max * 1e6 / PROFILE_FREQUENCY);
+    printf("profile: stack high-water mark %u of 2048 bytes\n", stack_high << 8 | stack_low);
+    add_metric("isr_max_cycles", handlers[worst_isr].max);
+    add_metric("stack_bytes", stack_high << 8 | stack_low);
+
+    if (output)
+        save_metrics(output);
+    if (baseline && compare_metrics(baseline, tolerance))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Markers shared by the profiling build of line.c (host/avr_profile.c, on the
+ * AVR) and the simavr runner that reads them (host/profile.c).
+ *
+ * GPIOR0 gets a handler's PROFILE_* number when it is entered and 0 when it
+ * returns, GPIOR1/GPIOR2 the stack high-water mark (low, high byte) at the
+ * end, and finally GPIOR0 gets PROFILE_DONE.
+ */
+#ifndef HOST_PROFILE_H
+#define HOST_PROFILE_H
+
+#define PROFILE_SETUP 1
+#define PROFILE_LOOP 2
+#define PROFILE_RX 3                // message_rx(), in the radio ISR on the bot
+#define PROFILE_TX 4                // message_tx(), in the transmit timer ISR
+#define PROFILE_TX_SUCCESS 5        // message_tx_success(), likewise
+#define PROFILE_HANDLERS 6
+#define PROFILE_DONE 0xFF
+
+#define STACK_PAINT 0xC5            // fill byte of the unused stack
+
+// ATmega328p data space addresses of the general purpose I/O registers
+#define GPIOR0_ADDR 0x3E
+#define GPIOR1_ADDR 0x4A
+#define GPIOR2_ADDR 0x4B
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * Offline replay of a line.c message trace (see TRACE in line.h).
+ *
+ * Record one with a -DTRACE build of the simulator (make line_trace), then
+ *
+ *   ./line_replay [-l] [-u uid] [-t tick] [-n passes] [-v] trace.bin
+ *
+ * Every TRACE_SETUP record runs setup() for its bot with the recorded my_id,
+ * and every TRACE_RX record is fed to handle_message(), i.e. the
+ * recv_sharing(), recv_joining(), recv_elect(), recv_move() and recv_digest()
+ * handlers, with kilo_ticks and kilo_uid as recorded. A TRACE_REDRAW right
+ * after it gives the id redraw_id() drew in that handler. With -l the TRACE_LOOP
+ * and TRACE_TX_SUCCESS records also run loop() and message_tx_success(), which
+ * replays the whole bot; its timer jitter then comes from a per bot generator
+ * seeded with kilo_uid rather than the simulator's, so -l runs are repeatable
+ * but can drift from the recorded run once rand_soft() is involved.
+ *
+ *   -u uid     replay only this bot
+ *   -t tick    stop at the first record after this tick, for bisecting
+ *   -n passes  replay the trace this many times (from scratch) for profiling
+ *   -v         print the state of every bot at the end
+ *
+ * It prints the event rate and a checksum of the ring and neighbor state of
+ * all bots, so two builds of line.c can be compared on the same trace.
+ */
+#define HOST_TOOL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kilombo.h"
+#include "line.h"
+
+extern HOST_TLS USERDATA *mydata;
+void setup(void);
+void loop(void);
+void handle_message(uint8_t *payload, uint8_t distance);
+void message_tx_success(void);
+
+typedef struct {
+    uint32_t tick;
+    uint16_t uid;
+    uint8_t event;
+    uint8_t distance;
+    uint8_t payload[9];
+} record_t;
+
+// kilolib as seen by line.c
+uint32_t kilo_ticks;
+HOST_TLS uint16_t kilo_uid;
+uint8_t kilo_turn_left = 70, kilo_turn_right = 70, kilo_straight_left = 70, kilo_straight_right = 70;
+message_t *(*kilo_message_tx)(void);
+void (*kilo_message_tx_success)(void);
+void (*kilo_message_rx)(message_t *, distance_measurement_t *);
+
+static USERDATA *bots;              // one USERDATA per bot, in order of their TRACE_SETUP
+static uint32_t *rand_state;        // and its rand_soft() generator
+static uint16_t *bot_uid;
+static int num_bots;
+static int bot_of[65536];           // kilo_uid -> index into bots, -1 if not set up yet
+static int current;                 // bot being run
+static uint8_t id_draws[2];         // rand_soft() results the next my_id draw gets, see ID_DRAWS
+static int num_id_draws;
+
+uint8_t rand_soft(void)
+{
+    if (num_id_draws)
+        return id_draws[ID_DRAWS - num_id_draws--];
+    rand_state[current] = rand_state[current] * 1103515245 + 12345;
+    return rand_state[current] >> 16;
+}
+
+uint8_t rand_hard(void) { return kilo_uid; }
+void rand_seed(uint8_t seed) { (void) seed; }
+uint8_t estimate_distance(const distance_measurement_t *d) { return d->high_gain; }
+void set_motors(uint8_t ccw, uint8_t cw) { (void) ccw; (void) cw; }
+void set_color(uint8_t color) { (void) color; }
+void delay(uint16_t ms) { (void) ms; }
+uint16_t message_crc(const message_t *msg) { (void) msg; return 0; }
+void kilo_init(void) { }
+void kilo_start(void (*setup)(void), void (*loop)(void)) { (void) setup; (void) loop; }
+
+static record_t *load_trace(const char *name, long *count)
+{
+    FILE *f = fopen(name, "rb");
+    uint8_t raw[TRACE_RECORD_SIZE];
+    record_t *records = 0;
+    long n = 0, size = 0;
+
+    if (!f)
+    {
+        perror(name);
+        exit(1);
+    }
+    while (fread(raw, TRACE_RECORD_SIZE, 1, f) == 1)
+    {
+        if (n == size)
+        {
+            size = size ? 2 * size : 1 << 16;
+            records = realloc(records, size * sizeof(record_t));
+            if (!records)
+            {
+                fprintf(stderr, "replay: out of memory\n");
+                exit(1);
+            }
+        }
+        records[n].tick = raw[0] | raw[1] << 8 | (uint32_t) raw[2] << 16 | (uint32_t) raw[3] << 24;
+        records[n].uid = raw[4] | raw[5] << 8;
+        records[n].event = raw[6];
+        records[n].distance = raw[7];
+        memcpy(records[n].payload, raw + 8, 9);
+        n++;
+    }
+    fclose(f);
+    *count = n;
+    return records;
+}
+
+static void start_bot(const record_t *r)
+{
+    if (bot_of[r->uid] < 0)
+    {
+        bots = realloc(bots, (num_bots + 1) * sizeof(USERDATA));
+        rand_state = realloc(rand_state, (num_bots + 1) * sizeof(uint32_t));
+        bot_uid = realloc(bot_uid, (num_bots + 1) * sizeof(uint16_t));
+        if (!bots || !rand_state || !bot_uid)
+        {
+            fprintf(stderr, "replay: out of memory\n");
+            exit(1);
+        }
+        bot_of[r->uid] = num_bots++;
+    }
+    current = bot_of[r->uid];
+    memset(&bots[current], 0, sizeof(USERDATA));
+    rand_state[current] = r->uid;
+    bot_uid[current] = r->uid;
+    mydata = &bots[current];
+
+    id_draws[0] = r->payload[0];
+    id_draws[1] = r->payload[1];
+    num_id_draws = ID_DRAWS;    // a -DWIDE_IDS setup() takes none unless kilo_uid maps to id 0
+    setup();
+    num_id_draws = 0;
+}
+
+// Replays records [0, n), returns the number of handler calls
+static long replay(const record_t *records, long n, int full, int only_uid, long stop_tick, uint32_t *last_tick)
+{
+    long i, handled = 0;
+
+    num_bots = 0;
+    memset(bot_of, -1, sizeof(bot_of));
+
+    for (i = 0; i < n; i++)
+    {
+        const record_t *r = &records[i];
+
+        if (stop_tick >= 0 && r->tick > stop_tick)
+            break;
+        if (only_uid >= 0 && r->uid != only_uid)
+            continue;
+        kilo_ticks = r->tick;
+        kilo_uid = r->uid;
+        *last_tick = r->tick;
+        if (r->event == TRACE_SETUP)
+        {
+            start_bot(r);
+            continue;
+        }
+        if (bot_of[r->uid] < 0)
+            continue;           // trace started after this bot's setup()
+        current = bot_of[r->uid];
+        mydata = &bots[current];
+
+        switch (r->event)
+        {
+            case TRACE_RX:
+            {
+                uint8_t payload[9];
+                memcpy(payload, r->payload, 9);     // the handlers may not write it, but don't trust that
+                if (i + 1 < n && records[i + 1].event == TRACE_REDRAW && records[i + 1].uid == r->uid)
+                {
+                    id_draws[0] = records[i + 1].payload[0];    // this message makes redraw_id() draw again
+                    id_draws[1] = records[i + 1].payload[1];
+                    num_id_draws = ID_DRAWS;
+                }
+                handle_message(payload, r->distance);
+                num_id_draws = 0;
+                handled++;
+                break;
+            }
+            case TRACE_LOOP:
+                if (full)
+                    loop();
+                break;
+            case TRACE_TX_SUCCESS:
+                if (full)
+                    message_tx_success();
+                break;
+        }
+    }
+    return handled;
+}
+
+// FNV-1a over the ring and neighbor state of every bot
+static uint32_t checksum(void)
+{
+    uint32_t h = 2166136261u;
+    int b, i;
+
+#define MIX(x) (h = (h ^ (uint8_t) (x)) * 16777619u)
+    for (b = 0; b < num_bots; b++)
+    {
+        USERDATA *d = &bots[b];
+
+        MIX(bot_uid[b]);
+        MIX(bot_uid[b] >> 8);
+        MIX(d->my_id);
+        MIX(d->my_left);
+        MIX(d->my_right);
+        MIX(d->state);
+        MIX(d->leader_id);
+        MIX(d->election_epoch);
+        MIX(d->has_decided);
+        MIX(d->num_neighbors);
+        for (i = 0; i < d->num_neighbors; i++)
+        {
+            MIX(d->nearest_neighbors[i].id);
+            MIX(d->nearest_neighbors[i].left_id);
+            MIX(d->nearest_neighbors[i].right_id);
+            MIX(d->nearest_neighbors[i].distance);
+            MIX(d->nearest_neighbors[i].state);
+        }
+    }
+#undef MIX
+    return h;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: line_replay [-l] [-u uid] [-t tick] [-n passes] [-v] trace.bin\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int full = 0, verbose = 0, only_uid = -1, passes = 1, pass, b, i;
+    long stop_tick = -1, n, handled = 0;
+    uint32_t last_tick = 0;
+    record_t *records;
+    clock_t start;
+    double seconds;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (!strcmp(argv[i], "-l"))
+            full = 1;
+        else if (!strcmp(argv[i], "-v"))
+            verbose = 1;
+        else if (!strcmp(argv[i], "-u") && i + 1 < argc)
+            only_uid = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            stop_tick = atol(argv[++i]);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            passes = atoi(argv[++i]);
+        else
+            usage();
+    }
+    if (i != argc - 1 || passes < 1)
+        usage();
+
+    records = load_trace(argv[i], &n);
+
+    start = clock();
+    for (pass = 0; pass < passes; pass++)
+        handled += replay(records, n, full, only_uid, stop_tick, &last_tick);
+    seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("replay: %ld records, %d bots, last tick %lu\n", n, num_bots, (unsigned long) last_tick);
+    printf("replay: %ld messages handled in %.3f s (%.2f M/s)%s\n", handled, seconds,
+           seconds > 0 ? handled / seconds / 1e6 : 0.0, full ? ", with loop()" : "");
+    printf("replay: checksum %08lx\n", (unsigned long) checksum());
+
+    if (verbose)
+        for (b = 0; b < num_bots; b++)
+            printf("uid %u: my_id %d left %d right %d state %d leader %d epoch %d decided %d neighbors %d\n",
+                   bot_uid[b], bots[b].my_id, bots[b].my_left, bots[b].my_right, bots[b].state,
+                   bots[b].leader_id, bots[b].election_epoch, bots[b].has_decided, bots[b].num_neighbors);
+
+    free(records);
+    return 0;
+}
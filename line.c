@@ -1,4 +1,6 @@
+#ifndef KILOBOT
 #define SIMULATOR
+#endif
 
 
 #ifndef SIMULATOR
@@ -11,6 +13,12 @@
     #include <math.h>
     #include <kilombo.h>
     #include <stdio.h> // for printf
+    #ifdef TRACE
+    #include <stdlib.h> // for getenv, exit
+    #endif
+    #ifndef HOST
+    #include <jansson.h>
+    #endif
     #include "line.h"
     REGISTER_USERDATA(USERDATA)
 #endif
@@ -27,16 +35,129 @@ void print_state()
 
 void send_joining();
 
+#ifdef STATS
+#ifdef SWEEP
+/**
+ * Event log read by sweep.sh. One line per transition:
+ *   SWEEP <tick> <uid> COOP|AUTO|DECIDED|UNDECIDED|RESET
+ **/
+void sweep_event(const char *event)
+{
+    printf("SWEEP %lu %d %s\n", (unsigned long) kilo_ticks, kilo_uid, event);
+}
+#else
+#define sweep_event(event)
+#endif
+
+static const char *message_names[NUM_MSG_TYPES] = { "NULL", "SHARE", "JOIN", "LEAVE", "MOVE", "ELECT", "DIGEST" };
+
+/**
+ * Records state and has_decided transitions, called at the end of loop().
+ **/
+void stats_loop()
+{
+    if (mydata->state != mydata->stats.last_state)
+    {
+        if (mydata->state == COOPERATIVE)
+            mydata->stats.coop_tick = kilo_ticks;
+        sweep_event(mydata->state == COOPERATIVE ? "COOP" : "AUTO");
+        mydata->stats.last_state = mydata->state;
+    }
+    if (mydata->has_decided != mydata->stats.last_decided)
+    {
+        if (mydata->has_decided)
+            mydata->stats.decided_tick = kilo_ticks;
+        sweep_event(mydata->has_decided ? "DECIDED" : "UNDECIDED");
+        mydata->stats.last_decided = mydata->has_decided;
+    }
+}
+#endif
+
+#ifdef TRACE
+/**
+ * Appends one event of this bot to the trace file, see TRACE in line.h.
+ * All bots of a simulation share the file, in the order kilombo runs them.
+ **/
+void trace_record(trace_event event, uint8_t distance, const uint8_t *payload)
+{
+    static FILE *trace;
+    uint8_t record[TRACE_RECORD_SIZE] = { 0 };
+    uint8_t i;
+
+    if (!trace)
+    {
+        const char *name = getenv("KILO_TRACE");
+        trace = fopen(name ? name : TRACE_FILE, "wb");
+        if (!trace)
+        {
+            perror("trace_record");
+            exit(1);
+        }
+    }
+    for (i = 0; i < 4; i++)
+        record[i] = kilo_ticks >> (8 * i);
+    record[4] = kilo_uid;
+    record[5] = kilo_uid >> 8;
+    record[6] = event;
+    record[7] = distance;
+    for (i = 0; payload && i < 9; i++)
+        record[8 + i] = payload[i];
+    fwrite(record, TRACE_RECORD_SIZE, 1, trace);
+}
+#else
+#define trace_record(event, distance, payload)
+#endif
+
 void recv_elect();
 
-char isQueueFull()
+char adopt_leader(uint8_t *payload);
+void redraw_id();
+
+
+/**
+ * Arms timer t to expire ticks from now.
+ **/
+void timer_set(uint8_t t, uint16_t ticks)
+{
+    mydata->deadline[t] = mydata->now + ticks;
+    mydata->timers_armed |= 1 << t;
+}
+
+void timer_cancel(uint8_t t)
+{
+    mydata->timers_armed &= ~(1 << t);
+}
+
+/**
+ * Returns 1 and disarms timer t if it is armed and its deadline has passed.
+ **/
+char timer_due(uint8_t t)
 {
-    return (mydata->tail +1) % QUEUE == mydata->head;
+    if ((mydata->timers_armed & (1 << t)) && (int16_t)(mydata->now - mydata->deadline[t]) >= 0)
+    {
+        timer_cancel(t);
+        return 1;
+    }
+    return 0;
 }
 
+/**
+ * Returns 1 if any armed timer has expired, without disarming it.
+ **/
+char timers_expired()
+{
+    uint8_t t;
+    for (t = 0; t < NUM_TIMERS; t++)
+    {
+        if ((mydata->timers_armed & (1 << t)) && (int16_t)(mydata->now - mydata->deadline[t]) >= 0)
+            return 1;
+    }
+    return 0;
+}
 
 
-/* Helper function for setting motor speed smoothly
+/* Helper function for setting motor speed smoothly.
+ * The spin-up does not block: the real speed is set by loop() once TIMER_MOTOR expires.
  */
 void smooth_set_motors(uint8_t ccw, uint8_t cw)
 {
@@ -50,16 +171,23 @@ void smooth_set_motors(uint8_t ccw, uint8_t cw)
     if (l || r)        // at least one motor needs spin-up
     {
         set_motors(l, r);
-        delay(15);
+        mydata->motor_ccw = ccw;
+        mydata->motor_cw = cw;
+        timer_set(TIMER_MOTOR, SPINUP_TIME);
+        return;
     }
 #endif
-    // spin-up is done, now we set the real value
+    // no spin-up needed, set the real value
+    timer_cancel(TIMER_MOTOR);
     set_motors(ccw, cw);
 }
 
 
 void set_motion(motion_t new_motion)
 {
+    if (new_motion == mydata->motion_state)
+        return;
+    mydata->motion_state = new_motion;
     switch(new_motion) {
         case STOP:
             smooth_set_motors(0,0);
@@ -86,44 +214,165 @@ char in_interval(uint8_t distance)
 }
 
 
+// Has neighbor i shared the same state more than twice in a row?
+char is_neighbor_stable(uint8_t i)
+{
+    return mydata->nearest_neighbors[i].streak > 2;
+}
+
+
+// All neighbors stable? num_stable is kept up to date by recv_sharing()
 char is_stabilized()
 {
-    uint8_t i=0,j=0;
-    for (i=0; i<mydata->num_neighbors; i++)
+    return mydata->num_stable == mydata->num_neighbors;
+}
+
+
+// Home bucket of id in the neighbor index (linear probing from there)
+uint8_t neighbor_hash(bot_id_t id)
+{
+    return id & (NEIGHBOR_INDEX_SIZE - 1);
+}
+
+
+// Search for id in the neighboring nodes, returns num_neighbors if absent
+uint8_t exists_nearest_neighbor(bot_id_t id)
+{
+    uint8_t h = neighbor_hash(id);
+    while (mydata->neighbor_index[h])
     {
-        
-        if ((mydata->nearest_neighbors[i].state == AUTONOMOUS && mydata->nearest_neighbors[i].num > 2) ||
-            (mydata->nearest_neighbors[i].state == COOPERATIVE && mydata->nearest_neighbors[i].num_cooperative > 2))
-            j++;
+        if (mydata->nearest_neighbors[mydata->neighbor_index[h] - 1].id == id)
+            return mydata->neighbor_index[h] - 1;
+        h = (h + 1) & (NEIGHBOR_INDEX_SIZE - 1);
     }
+    return mydata->num_neighbors;
+}
 
-    return j == mydata->num_neighbors;
+
+// Register slot i (whose id is already set) in the neighbor index
+void index_nearest_neighbor(uint8_t i)
+{
+    uint8_t h = neighbor_hash(mydata->nearest_neighbors[i].id);
+    while (mydata->neighbor_index[h])
+        h = (h + 1) & (NEIGHBOR_INDEX_SIZE - 1);
+    mydata->neighbor_index[h] = i + 1;
 }
 
 
-// Search for id in the neighboring nodes
-uint8_t exists_nearest_neighbor(uint8_t id)
+// Take slot i (whose id is still set) out of the neighbor index
+void unindex_nearest_neighbor(uint8_t i)
 {
-    uint8_t i;
-    for (i=0; i<mydata->num_neighbors; i++)
+    uint8_t h = neighbor_hash(mydata->nearest_neighbors[i].id);
+    uint8_t j, k;
+    while (mydata->neighbor_index[h] != i + 1)
+        h = (h + 1) & (NEIGHBOR_INDEX_SIZE - 1);
+
+    // Backward shift: pull later entries of the probe run into the hole
+    j = h;
+    for (;;)
     {
-        if (mydata->nearest_neighbors[i].id == id)
-            return i;
+        j = (j + 1) & (NEIGHBOR_INDEX_SIZE - 1);
+        if (!mydata->neighbor_index[j])
+            break;
+        k = neighbor_hash(mydata->nearest_neighbors[mydata->neighbor_index[j] - 1].id);
+        // Move the entry unless its home bucket lies cyclically in (h, j]
+        if (((j - k) & (NEIGHBOR_INDEX_SIZE - 1)) >= ((j - h) & (NEIGHBOR_INDEX_SIZE - 1)))
+        {
+            mydata->neighbor_index[h] = mydata->neighbor_index[j];
+            h = j;
+        }
     }
-    return i;
+    mydata->neighbor_index[h] = 0;
 }
 
 
-// Search for id in the neighboring nodes
-uint8_t are_all_cooperative()
+// Forget every neighbor in the id and nearest indexes
+void clear_neighbor_index()
+{
+    uint8_t h;
+    for (h = 0; h < NEIGHBOR_INDEX_SIZE; h++)
+        mydata->neighbor_index[h] = 0;
+    mydata->num_nearest = 0;
+}
+
+
+// Filtered distance of neighbor i with its fraction bits, for comparisons
+uint16_t filtered_distance(uint8_t i)
+{
+    return (mydata->nearest_neighbors[i].distance << DISTANCE_SHIFT) | mydata->nearest_neighbors[i].distance_frac;
+}
+
+
+/**
+ * Puts slot i into the sorted nearest list if it is closer than its last entry.
+ * i must not be in the list.
+ **/
+void insert_nearest(uint8_t i)
+{
+    uint8_t k = mydata->num_nearest;
+
+    if (k == NEAREST_K)
+    {
+        if (filtered_distance(i) >= filtered_distance(mydata->nearest[k - 1]))
+            return;
+        k--;                    // The last one drops out
+    }
+    else
+        mydata->num_nearest++;
+    for (; k > 0 && filtered_distance(mydata->nearest[k - 1]) > filtered_distance(i); k--)
+        mydata->nearest[k] = mydata->nearest[k - 1];
+    mydata->nearest[k] = i;
+}
+
+
+// Rebuilds the nearest list from the whole table
+void rebuild_nearest()
 {
     uint8_t i;
-    for (i=0; i<mydata->num_neighbors; i++)
+
+    mydata->num_nearest = 0;
+    for (i = 0; i < mydata->num_neighbors; i++)
+        insert_nearest(i);
+}
+
+
+/**
+ * Keeps the nearest list in step after the distance of slot i changed from before
+ * (or i is new). Moving closer or staying out is O(NEAREST_K); a listed neighbor
+ * moving away may let an unlisted one in, which takes a rescan of the table.
+ **/
+void update_nearest(uint8_t i, uint16_t before)
+{
+    uint8_t k;
+
+    for (k = 0; k < mydata->num_nearest && mydata->nearest[k] != i; k++)
+        ;
+    if (k == mydata->num_nearest)
     {
-        if (mydata->nearest_neighbors[i].state == COOPERATIVE)
-            return 0;
+        insert_nearest(i);
+        return;
     }
-    return 1;
+    if (k + 1 < mydata->num_nearest && filtered_distance(mydata->nearest[k + 1]) < filtered_distance(i))
+    {
+        rebuild_nearest();
+        return;
+    }
+    if (k + 1 == mydata->num_nearest && mydata->num_neighbors > mydata->num_nearest
+        && filtered_distance(i) > before)
+    {
+        rebuild_nearest();      // The last listed one moved away, an unlisted one may be closer now
+        return;
+    }
+    for (; k > 0 && filtered_distance(mydata->nearest[k - 1]) > filtered_distance(i); k--)
+        mydata->nearest[k] = mydata->nearest[k - 1];
+    mydata->nearest[k] = i;
+}
+
+
+// Returns 1 if none of the neighbors is cooperative
+uint8_t are_all_cooperative()
+{
+    return mydata->num_cooperative_neighbors == 0;
 }
 
 
@@ -135,18 +384,9 @@ uint8_t get_nearest_two_neighbors()
     k = i = mydata->num_neighbors;
     if (are_all_cooperative())
     {
-        for (i=0; i<mydata->num_neighbors; i++)
-        {
-            // shortest
-            if (mydata->nearest_neighbors[i].distance < min_sum)
-            {
-                k = i;
-            }
-        }
-        if (k < mydata->num_neighbors)
-        {
-            i = k;
-        }
+        // shortest
+        if (mydata->num_nearest)
+            i = mydata->nearest[0];
     }
     else
     {
@@ -155,16 +395,23 @@ uint8_t get_nearest_two_neighbors()
             // Is it cooperative and at distance in [4cm,6cm]?
             if (mydata->nearest_neighbors[i].state == COOPERATIVE)
             {
+                uint16_t right_distance;
                 l = exists_nearest_neighbor(mydata->nearest_neighbors[i].right_id);
                 // Does the right exits in my table?
                 if (l < mydata->num_neighbors)
+                    right_distance = mydata->nearest_neighbors[l].distance;
+                // If not, its DIGEST bounds how far its right can be from me
+                else if (mydata->nearest_neighbors[i].right_distance &&
+                         in_interval(mydata->nearest_neighbors[i].distance + mydata->nearest_neighbors[i].right_distance))
+                    right_distance = mydata->nearest_neighbors[i].distance + mydata->nearest_neighbors[i].right_distance;
+                else
+                    continue;
+
+                uint16_t sum = mydata->nearest_neighbors[i].distance + right_distance;
+                if (sum < min_sum)
                 {
-                    if (mydata->nearest_neighbors[i].distance +
-                        mydata->nearest_neighbors[l].distance < min_sum)
-                    {
-                        min_sum = mydata->nearest_neighbors[i].distance + mydata->nearest_neighbors[l].distance;
-                        k = i;
-                    }
+                    min_sum = sum;
+                    k = i;
                 }
             }
         }
@@ -177,41 +424,198 @@ uint8_t get_nearest_two_neighbors()
 }
 
 
-void recv_sharing(uint8_t *payload, uint8_t distance)
+// Coarse kilo_ticks value ticks from now, comparable with nearest_neighbor_t.expires
+uint8_t expiry(uint16_t ticks)
 {
-    if (payload[ID] == mydata->my_id  || payload[ID] == 0 || !in_interval(distance) ) return;
+    return (uint8_t) ((kilo_ticks + ticks) >> EXPIRE_SHIFT);
+}
+
+
+/**
+ * Trickle reset: something changed around us, go back to the shortest SHARE interval.
+ **/
+void share_reset()
+{
+    if (mydata->share_interval == SHARING_TIME)
+        return;         // Already sharing fast, the next SHARE is at most SHARING_TIME away
+    mydata->share_interval = SHARING_TIME;
+    timer_set(TIMER_SHARE, SHARING_TIME / 2 + rand_soft() % (SHARING_TIME / 2));
+}
+
+
+/**
+ * Folds a distance sample into the EWMA of neighbor i, so that distanceNoise
+ * does not flip link choices from one loop to the next.
+ **/
+void filter_distance(uint8_t i, uint8_t distance)
+{
+    int16_t filtered = (mydata->nearest_neighbors[i].distance << DISTANCE_SHIFT) | mydata->nearest_neighbors[i].distance_frac;
+
+    filtered += (((int16_t) distance << DISTANCE_SHIFT) - filtered) >> DISTANCE_EWMA;
+    mydata->nearest_neighbors[i].distance = filtered >> DISTANCE_SHIFT;
+    mydata->nearest_neighbors[i].distance_frac = filtered & ((1 << DISTANCE_SHIFT) - 1);
+}
+
+
+/**
+ * Finds or adds the table slot of the sender of a message and notes that it was heard.
+ * Returns MAX_NUM_NEIGHBORS if the sender is not taken into the table.
+ **/
+uint8_t touch_nearest_neighbor(bot_id_t id, uint8_t distance)
+{
+    if (id == mydata->my_id)
+    {
+        redraw_id();        // another bot in range has my id
+        return MAX_NUM_NEIGHBORS;
+    }
+    if (id == 0 || !in_interval(distance) ) return MAX_NUM_NEIGHBORS;
     
-    uint8_t i = exists_nearest_neighbor(payload[ID]);
+    uint8_t i = exists_nearest_neighbor(id);
+    uint16_t before = 0;
     if (i >= mydata->num_neighbors) // The id has never received
     {
-        if (mydata->num_neighbors < MAX_NUM_NEIGHBORS)
-        {
-            i = mydata->num_neighbors;
-            mydata->num_neighbors++;
-            mydata->nearest_neighbors[i].num = 0;
-            
-        }
+        if (mydata->num_neighbors == MAX_NUM_NEIGHBORS) return MAX_NUM_NEIGHBORS;     // Table is full
+
+        i = mydata->num_neighbors;
+        mydata->num_neighbors++;
+        mydata->nearest_neighbors[i].streak = 0;
+        mydata->nearest_neighbors[i].state = AUTONOMOUS;
+        mydata->nearest_neighbors[i].message_received = 0;
+        mydata->nearest_neighbors[i].right_id = mydata->nearest_neighbors[i].left_id = id;
+        mydata->nearest_neighbors[i].right_distance = 0;
+        mydata->nearest_neighbors[i].color_id = 0;
+        mydata->nearest_neighbors[i].id = id;
+        mydata->nearest_neighbors[i].distance = distance;         // The first sample starts the filter
+        mydata->nearest_neighbors[i].distance_frac = 0;
+        mydata->nearest_neighbors[i].expires = expiry(MESSAGE_TIMEOUT);
+        index_nearest_neighbor(i);
+        share_reset();
+    }
+    else
+    {
+        before = filtered_distance(i);
+        filter_distance(i, distance);
+    }
+    update_nearest(i, before);
+    if (id == mydata->approach_target)
+        mydata->approach_fresh = 1;
+
+    // Any message keeps it alive for at least MESSAGE_TIMEOUT, a SHARE may extend that
+    if ((int8_t) (expiry(MESSAGE_TIMEOUT) - mydata->nearest_neighbors[i].expires) > 0)
+        mydata->nearest_neighbors[i].expires = expiry(MESSAGE_TIMEOUT);
+    if (!mydata->nearest_neighbors[i].message_received)
+    {
+        mydata->nearest_neighbors[i].message_received = 1;          // Toggle the message_received boolean as true when a message is shared from this ID.
+        mydata->num_received++;
     }
+    return i;
+}
 
-    mydata->nearest_neighbors[i].id = payload[ID];
-    mydata->nearest_neighbors[i].right_id = payload[RIGHT_ID];
-    mydata->nearest_neighbors[i].left_id = payload[LEFT_ID];
-    mydata->nearest_neighbors[i].state = payload[STATE];
-    mydata->nearest_neighbors[i].distance = distance;
-    // Testing
-    mydata->nearest_neighbors[i].color_id = payload[COLOR];
-    mydata->nearest_neighbors[i].message_received = 1;              // Toggle the message_received boolean as true when a message is shared from this ID.
-    if (payload[STATE] == AUTONOMOUS)
+
+#ifdef WIDE_IDS
+/**
+ * Reads field, a FIELD(offset, width), of a wide payload.
+ **/
+uint16_t get_field(const uint8_t *payload, uint16_t field)
+{
+    uint8_t byte = field >> 7, shift = (field >> 4) & 7, width = field & 0x0F, n;
+    uint32_t bits = 0;
+
+    for (n = 0; 8 * n < shift + width; n++)
+        bits |= (uint32_t) payload[byte + n] << (8 * n);
+    return (bits >> shift) & ((1 << width) - 1);
+}
+
+/**
+ * Writes value into field of a wide payload, leaving the other bits alone.
+ **/
+void put_field(uint8_t *payload, uint16_t field, uint16_t value)
+{
+    uint8_t byte = field >> 7, shift = (field >> 4) & 7, width = field & 0x0F, n;
+    uint32_t mask = (uint32_t) ((1 << width) - 1) << shift;
+    uint32_t bits = (uint32_t) value << shift & mask;
+
+    for (n = 0; 8 * n < shift + width; n++)
+        payload[byte + n] = (payload[byte + n] & ~(mask >> (8 * n))) | (bits >> (8 * n));
+}
+#endif
+
+// Distance step (DIGEST_UNIT) of entry k of a DIGEST
+uint8_t get_digest_dist(const uint8_t *payload, uint8_t k)
+{
+#ifdef WIDE_IDS
+    return get_field(payload, DIGEST_DIST(k));
+#else
+    return (payload[DIGEST_DISTS + k / 2] >> (k & 1 ? 4 : 0)) & 0x0F;
+#endif
+}
+
+void put_digest_dist(uint8_t *payload, uint8_t k, uint8_t step)
+{
+#ifdef WIDE_IDS
+    put_field(payload, DIGEST_DIST(k), step);
+#else
+    payload[DIGEST_DISTS + k / 2] |= step << (k & 1 ? 4 : 0);
+#endif
+}
+
+void recv_sharing(uint8_t *payload, uint8_t distance)
+{
+    uint8_t i = touch_nearest_neighbor(get_field(payload, ID), distance);
+    if (i == MAX_NUM_NEIGHBORS) return;
+
+    // Take this neighbor out of the running counts, it is added back below
+    mydata->num_stable -= is_neighbor_stable(i);
+    mydata->num_cooperative_neighbors -= mydata->nearest_neighbors[i].state == COOPERATIVE;
+
+    if (mydata->nearest_neighbors[i].state != get_field(payload, STATE))
+        mydata->nearest_neighbors[i].streak = 0;
+    if (mydata->nearest_neighbors[i].streak < STREAK_MAX)
+        mydata->nearest_neighbors[i].streak++;
+
+    if (get_field(payload, MSG) == SHARE)
     {
-        mydata->nearest_neighbors[i].num++;
-        mydata->nearest_neighbors[i].num_cooperative = 0;
+        uint8_t interval = get_field(payload, SHARE_INTERVAL) * SHARE_INTERVAL_UNIT;
+        if (LIVENESS_FACTOR * interval > MESSAGE_TIMEOUT)
+            mydata->nearest_neighbors[i].expires = expiry(LIVENESS_FACTOR * interval);
     }
-    else
+
+    if (mydata->nearest_neighbors[i].right_id != get_field(payload, RIGHT_ID))
     {
-        mydata->nearest_neighbors[i].num_cooperative++;
-        mydata->nearest_neighbors[i].num = 0;
+        mydata->nearest_neighbors[i].right_distance = 0;            // Wait for a DIGEST about the new right
+        if (get_field(payload, ID) == mydata->my_right)
+            mydata->round_counter = 0;      // my coloring started from its old right, start over
     }
+    if (mydata->nearest_neighbors[i].right_id != get_field(payload, RIGHT_ID) ||
+        mydata->nearest_neighbors[i].left_id != get_field(payload, LEFT_ID) ||
+        mydata->nearest_neighbors[i].state != get_field(payload, STATE))
+        share_reset();
+    mydata->nearest_neighbors[i].right_id = get_field(payload, RIGHT_ID);
+    mydata->nearest_neighbors[i].left_id = get_field(payload, LEFT_ID);
+    mydata->nearest_neighbors[i].state = get_field(payload, STATE);
+    // Testing
+    if (get_field(payload, MSG) != MOVE)
+        mydata->nearest_neighbors[i].color_id = get_field(payload, COLOR);
+
+    mydata->num_stable += is_neighbor_stable(i);
+    mydata->num_cooperative_neighbors += mydata->nearest_neighbors[i].state == COOPERATIVE;
+}
+
+/**
+ * Learns from a neighbor's DIGEST how far it is from its right, before that bot is in our own table.
+ **/
+void recv_digest(uint8_t *payload, uint8_t distance)
+{
+    uint8_t i = touch_nearest_neighbor(get_field(payload, ID), distance);
+    uint8_t k;
+    if (i == MAX_NUM_NEIGHBORS) return;
 
+    for (k = 0; k < DIGEST_ENTRIES; k++)
+    {
+        bot_id_t id = get_field(payload, DIGEST_ID(k));
+        if (id && id == mydata->nearest_neighbors[i].right_id)
+            mydata->nearest_neighbors[i].right_distance = get_digest_dist(payload, k) * DIGEST_UNIT + DIGEST_UNIT / 2;
+    }
 }
 
 /**
@@ -225,19 +629,19 @@ void recv_joining(uint8_t *payload)
         printf("DEBUG(payload): id: %d, right: %d, left: %d, reciever: %d, state: %d\n", payload[ID], payload[RIGHT_ID], payload[LEFT_ID], payload[RECEIVER], payload[STATE]);
     #endif*/
 
-    if(mydata->my_id == payload[RECEIVER])
+    if(mydata->my_id == get_field(payload, RECEIVER))
     {
-        if (mydata->my_id == payload[LEFT_ID])
+        if (mydata->my_id == get_field(payload, LEFT_ID))
         {
-            mydata->my_right = payload[ID];
+            mydata->my_right = get_field(payload, ID);
             /*#ifdef SIMULATOR
             printf("Recv joining 1 - ");
             print_state();
             #endif*/
         }
-        if (mydata->my_id == payload[RIGHT_ID])
+        if (mydata->my_id == get_field(payload, RIGHT_ID))
         {
-            mydata->my_left = payload[ID];
+            mydata->my_left = get_field(payload, ID);
             /*#ifdef SIMULATOR
             printf("Recv joining 2 - ");
             print_state();
@@ -256,89 +660,262 @@ void recv_joining(uint8_t *payload)
     }
 }
 
+/**
+ * Takes the MOVE token if it is addressed to me and from a round I have not
+ * had yet; repeats and tokens the leader has since replaced are dropped.
+ * After token_resync any round is taken, since the leader may have gone on
+ * by 128 rounds or more while I was out of the ring.
+ * The leader gets its own round back, which closes the round trip.
+ **/
 void recv_move(uint8_t *payload)
 {
-/*#ifdef SIMULATOR
-    printf("%d Receives move %d %d %d\n", mydata->my_id, payload[MSG], mydata->my_id, payload[RECEIVER]);
-#endif*/
-    
-    if (mydata->my_id == payload[RECEIVER])
+    if (mydata->my_id != get_field(payload, RECEIVER) || get_field(payload, LEADER) != mydata->leader_id)
+        return;
+    if (mydata->is_leader ? get_field(payload, TOKEN_ROUND) != mydata->token_round || mydata->token
+                          : !mydata->token_resync && (int8_t)(get_field(payload, TOKEN_ROUND) - mydata->token_round) <= 0)
     {
-        mydata->token  = 1;
-        //mydata->blue  = 1;
-        mydata->send_token = mydata->now + TOKEN_TIME * 4.0;
-
+#ifdef STATS
+        mydata->stats.tokens_dropped++;
+#endif
+        return;
     }
-   /* else if (my_id == payload[SENDER])
+
+    if (mydata->is_leader)
     {
-        mydata->motion_state = STOP;
+        mydata->token_rtt = mydata->now - mydata->token_sent;
+        mydata->token_timeout = mydata->token_rtt < TOKEN_LOSS_MAX / 2 ? 2 * mydata->token_rtt : TOKEN_LOSS_MAX;
+        if (mydata->token_timeout < TOKEN_LOSS_TIME)
+            mydata->token_timeout = TOKEN_LOSS_TIME;
+        timer_cancel(TIMER_TOKEN);
+        mydata->token_round++;          // next round
     }
     else
-    {
-        mydata->msg.data[MSG]      = payload[MSG];
-        mydata->msg.data[ID]       = mydata->my_id;
-        mydata->msg.data[RECEIVER] = payload[RECEIVER];
-        mydata->msg.data[SENDER]   = payload[SENDER];
-        mydata->msg.type           = NORMAL;
-        mydata->msg.crc            = message_crc(&msg);
-        mydata->message_sent       = 0;
-    } */
+        mydata->token_round = get_field(payload, TOKEN_ROUND);
+    mydata->token_resync = 0;
+    mydata->token = 1;
+    mydata->blue = 1;
 }
 
 
+/**
+ * Hands a received payload to the recv_* handlers. Also the entry point of host/replay.c.
+ **/
+void handle_message(uint8_t *payload, uint8_t distance)
+{
+    mydata->rx_pending = 1;
+#ifdef STATS
+    if (get_field(payload, MSG) < NUM_MSG_TYPES)
+        mydata->stats.rx[get_field(payload, MSG)]++;
+#endif
+
+    if (get_field(payload, MSG) == DIGEST)
+    {
+        recv_digest(payload, distance);
+        return;
+    }
+    recv_sharing(payload, distance);
+    if (get_field(payload, MSG) != ELECT)
+        adopt_leader(payload);      // every message carries LEADER and EPOCH
+    switch (get_field(payload, MSG))
+    {
+        case JOIN:
+            recv_joining(payload);
+            break;
+        case MOVE:
+            recv_move(payload);
+            break;
+        case ELECT:
+            recv_elect(payload);
+            break;
+    }
+}
+
+/**
+ * Queues a NORMAL message for loop(). Runs in the radio ISR on the bot, so it
+ * only copies; a message that finds the ring full is dropped. JOIN, ELECT and
+ * MOVE are sent several times, so a later copy may still get in. SHARE and
+ * DIGEST are sent once, and only the sender's next one makes up for a drop.
+ **/
 void message_rx(message_t *m, distance_measurement_t *d)
 {
-    uint8_t dist = estimate_distance(d);
-    
-    if (m->type == NORMAL && m->data[MSG] !=NULL_MSG)
+    uint8_t head = mydata->rx_head, i;
+    rx_entry_t *e;
+
+    if (m->type != NORMAL)
+        return;
+    if ((uint8_t) (head - mydata->rx_tail) == RX_RING_SIZE)
     {
-        
-/*#ifdef SIMULATOR
-        printf("%d Receives %d %d\n", mydata->my_id,  m->data[MSG], m->data[RECEIVER]);
-#endif*/
-   
-        recv_sharing(m->data, dist);
-        switch (m->data[MSG])
+#ifdef STATS
+        mydata->stats.rx_dropped++;
+#endif
+        return;
+    }
+    e = &mydata->rx_ring[head & (RX_RING_SIZE - 1)];
+    for (i = 0; i < sizeof(e->payload); i++)
+        e->payload[i] = m->data[i];
+    e->distance = *d;
+    RX_BARRIER();
+    mydata->rx_head = head + 1;
+}
+
+/**
+ * Hands the messages message_rx() queued to handle_message(), oldest first.
+ **/
+void drain_rx_ring()
+{
+    uint8_t tail = mydata->rx_tail, dist;
+    rx_entry_t *e;
+
+    while (tail != mydata->rx_head)
+    {
+        RX_BARRIER();
+        e = &mydata->rx_ring[tail & (RX_RING_SIZE - 1)];
+        if (get_field(e->payload, MSG) != NULL_MSG)
         {
-            case JOIN:
-                recv_joining(m->data);
-                break;
-            case MOVE:
-                recv_move(m->data);
-                break;
-            case ELECT:
-                recv_elect(m->data);
-                break;
+            dist = estimate_distance(&e->distance);
+            trace_record(TRACE_RX, dist, e->payload);
+            handle_message(e->payload, dist);
         }
+        RX_BARRIER();
+        mydata->rx_tail = ++tail;
     }
 }
 
 
+/**
+ * Outbox slot and repeat count of a message type.
+ * Returns OUTBOX_SLOTS for types that are never sent.
+ **/
+uint8_t outbox_slot(uint8_t m, uint8_t *repeats)
+{
+    switch (m)
+    {
+        case JOIN:
+            *repeats = JOIN_REPEATS;
+            return OUTBOX_JOIN;
+        case ELECT:
+            *repeats = ELECT_REPEATS;
+            return OUTBOX_ELECT;
+        case MOVE:
+            *repeats = MOVE_REPEATS;
+            return OUTBOX_MOVE;
+        case SHARE:
+            *repeats = SHARE_REPEATS;
+            return OUTBOX_SHARE;
+        case DIGEST:
+            *repeats = DIGEST_REPEATS;
+            return OUTBOX_DIGEST;
+    }
+    return OUTBOX_SLOTS;
+}
+
+
+/**
+ * Marks a message of type m for sending, replacing a pending one of the same type.
+ * The message itself is built by stage_message() from the state at that time.
+ **/
 char enqueue_message(uint8_t m)
 {
-#ifdef SIMULATOR
- //   printf("%d, Prepare %d\n", mydata->my_id, m);
+    uint8_t repeats;
+    uint8_t slot = outbox_slot(m, &repeats);
+    if (slot == OUTBOX_SLOTS)
+        return 0;
+
+#ifdef STATS
+    if (mydata->repeats[slot])
+        mydata->stats.overwritten++;
 #endif
-    if (!isQueueFull())
-    {
-        mydata->message[mydata->tail].data[MSG] = m;
-        mydata->message[mydata->tail].data[ID] = mydata->my_id;
-        mydata->message[mydata->tail].data[RIGHT_ID] = mydata->my_right;
-        mydata->message[mydata->tail].data[LEFT_ID] = mydata->my_left;
-        mydata->message[mydata->tail].data[RECEIVER] = mydata->my_right;
-        mydata->message[mydata->tail].data[SENDER] = mydata->my_id;
-        mydata->message[mydata->tail].data[STATE] = mydata->state;
-
-        mydata->message[mydata->tail].data[COLOR] = mydata->color_id;
-        mydata->message[mydata->tail].data[LEADER] = mydata->leader_id;
-        
-        mydata->message[mydata->tail].type = NORMAL;
-        mydata->message[mydata->tail].crc = message_crc(&mydata->message[mydata->tail]);
-        mydata->tail++;
-        mydata->tail = mydata->tail % QUEUE;
-        return 1;
+    if (slot == mydata->tx_slot)
+        mydata->tx_slot = OUTBOX_SLOTS;     // Staged copy is out of date
+    mydata->repeats[slot] = repeats;
+    return 1;
+}
+
+/**
+ * Adds the neighbor with id to entry k of a DIGEST, unless it is not in the table.
+ **/
+uint8_t digest_entry(message_t *msg, uint8_t k, bot_id_t id)
+{
+    uint8_t i = exists_nearest_neighbor(id);
+    uint8_t step;
+    if (i == mydata->num_neighbors || k == DIGEST_ENTRIES)
+        return k;
+
+    step = mydata->nearest_neighbors[i].distance / DIGEST_UNIT;
+    if (step > 0x0F)
+        step = 0x0F;
+    put_field(msg->data, DIGEST_ID(k), id);
+    put_digest_dist(msg->data, k, step);
+    return k + 1;
+}
+
+/**
+ * Fills in the DIGEST payload, which stage_message() cleared: my_right and my_left, then the next neighbors of the table in turn.
+ **/
+void build_digest(message_t *msg)
+{
+    uint8_t k, n;
+
+    k = digest_entry(msg, 0, mydata->my_right);
+    if (mydata->my_left != mydata->my_right)
+        k = digest_entry(msg, k, mydata->my_left);
+
+    for (n = 0; n < mydata->num_neighbors && k < DIGEST_ENTRIES; n++)
+    {
+        if (mydata->digest_next >= mydata->num_neighbors)
+            mydata->digest_next = 0;
+        bot_id_t id = mydata->nearest_neighbors[mydata->digest_next++].id;
+        if (id != mydata->my_right && id != mydata->my_left)
+            k = digest_entry(msg, k, id);
     }
-    return 0;
+}
+
+/**
+ * Builds the highest priority pending message into tx_message, unless it is already there.
+ * tx_slot is only set once the message is complete, message_tx() sends nothing until then.
+ **/
+void stage_message()
+{
+    static const uint8_t slot_types[OUTBOX_SLOTS] = { JOIN, ELECT, MOVE, SHARE, DIGEST };
+    uint8_t slot, i;
+
+    for (slot = 0; slot < OUTBOX_SLOTS && !mydata->repeats[slot]; slot++)
+        ;
+    if (slot == mydata->tx_slot)
+        return;
+
+    mydata->tx_slot = OUTBOX_SLOTS;
+    if (slot == OUTBOX_SLOTS)
+        return;
+
+    message_t *msg = &mydata->tx_message;
+    for (i = 0; i < sizeof(msg->data); i++)
+        msg->data[i] = 0;       // unused fields go out as 0
+    put_field(msg->data, MSG, slot_types[slot]);
+    put_field(msg->data, ID, mydata->my_id);
+    if (slot == OUTBOX_DIGEST)
+        build_digest(msg);
+    else
+    {
+        put_field(msg->data, RIGHT_ID, mydata->my_right);
+        put_field(msg->data, LEFT_ID, mydata->my_left);
+        if (slot == OUTBOX_SHARE)
+            put_field(msg->data, SHARE_INTERVAL, (mydata->share_interval + SHARE_INTERVAL_UNIT - 1) / SHARE_INTERVAL_UNIT);
+        else
+            put_field(msg->data, RECEIVER, mydata->my_right);
+        put_field(msg->data, EPOCH, mydata->has_decided ? mydata->election_epoch : 0);
+        put_field(msg->data, STATE, mydata->state);
+
+        if (slot == OUTBOX_MOVE)
+            put_field(msg->data, COLOR, mydata->token_round);
+        else
+            put_field(msg->data, COLOR, mydata->round_counter ? mydata->round_counter << 4 | mydata->color_id : 0);
+        put_field(msg->data, LEADER, mydata->leader_id);
+    }
+
+    msg->type = NORMAL;
+    msg->crc = message_crc(msg);
+    mydata->tx_slot = slot;
 }
 
 /**********************************/
@@ -348,11 +925,11 @@ void send_joining()
     uint8_t i;
     /* precondition  */
     
-    if (mydata->state == AUTONOMOUS && is_stabilized()  && !isQueueFull())
+    if (mydata->state == AUTONOMOUS && is_stabilized())
     {
 
         i = get_nearest_two_neighbors();
-        if (i < mydata->num_neighbors && mydata->message_sent == 1)
+        if (i < mydata->num_neighbors)
         {
             // effect:
             // Added color to the join sender.
@@ -376,99 +953,169 @@ void send_joining()
 void send_sharing()
 {
     // Precondition
-    if (mydata->now >= mydata->nextShareSending  && !isQueueFull())
+    if (timer_due(TIMER_SHARE))
     {
         // Sending
         enqueue_message(SHARE);
-        // effect:
-        mydata->nextShareSending = mydata->now + SHARING_TIME;
+        if (mydata->state == COOPERATIVE && ++mydata->share_count >= DIGEST_PERIOD)
+        {
+            mydata->share_count = 0;
+            enqueue_message(DIGEST);
+        }
+        // effect: back off while nothing changes, at a random point of the next interval
+        if (mydata->share_interval < SHARING_TIME_MAX / 2)
+            mydata->share_interval *= 2;
+        else
+            mydata->share_interval = SHARING_TIME_MAX;
+        timer_set(TIMER_SHARE, mydata->share_interval / 2 + rand_soft() % (mydata->share_interval / 2));
     }
 }
 
 
+/**
+ * Passes the token on to my_right, see move(). The leader starts timing the round.
+ **/
 void send_move()
 {
     // Precondition:
-    if (mydata->state == COOPERATIVE  && mydata->token )
+    if (mydata->state == COOPERATIVE && mydata->token && mydata->my_right != mydata->my_id)
     {
-        mydata->send_token = mydata->now + TOKEN_TIME;
-    }
-    if (mydata->state == COOPERATIVE && !isQueueFull() && mydata->token && mydata->send_token <= mydata->now)
-    {
-            // Sending
         enqueue_message(MOVE);
         mydata->token = 0;
-        //mydata->blue = 0;
+        mydata->blue = 0;
         // effect:
+        if (mydata->is_leader)
+        {
+            mydata->token_sent = mydata->now;
+            timer_set(TIMER_TOKEN, mydata->token_timeout);
+        }
     }
-
 }
 
-void move(uint8_t tick)
+/**
+ * Leader only: creates the ring's token, and replaces it when it does not
+ * come back within token_timeout. Each replacement doubles the timeout, up
+ * to TOKEN_LOSS_MAX, so a ring slower than the timeout still gets a round through.
+ * An expired TIMER_TOKEN is taken even while the leader is out of the ring.
+ **/
+void check_token()
 {
-    // Precondition:
-    if (mydata->motion_state == ACTIVE && mydata->state == COOPERATIVE)
+    char lost;
+
+    if (!mydata->is_leader)
+        return;
+    lost = timer_due(TIMER_TOKEN);      // consumed even while I cannot act on it, so loop() can go idle
+    if (mydata->state != COOPERATIVE || mydata->token || (mydata->timers_armed & (1 << TIMER_TOKEN)))
+        return;
+    if (lost)
     {
-        
-      /*  if (mydata->time_active == mydata->move_motion[mydata->move_state].time)
-        {
-            // Effect:
-            mydata->green = 1;
-            mydata->move_state++;
-            if (mydata->move_state == 3)
-            {
-                mydata->send_token = 1;
-                send_move();
-#ifdef SIMULATOR
-                printf("Sending Move %d\n", mydata->my_id);
+#ifdef STATS
+        mydata->stats.tokens_regenerated++;
 #endif
-                mydata->motion_state = STOP;
-                return;
-            }
-            mydata->time_active = 0;
-        
-        }
-        set_motion(mydata->move_motion[mydata->move_state].motion);
-        mydata->time_active++;
-       */
+        mydata->token_timeout = mydata->token_timeout < TOKEN_LOSS_MAX / 2 ? 2 * mydata->token_timeout : TOKEN_LOSS_MAX;
     }
-    else
+    mydata->token_round++;              // a new round, the lost token is dropped wherever it turns up
+    mydata->token = 1;
+    mydata->blue = 1;
+}
+
+/**
+ * Motion engine. Runs move_motion[0 .. move_length) one step at a time, each
+ * step's motion for time * MOTION_STEP ticks. Steps end on TIMER_MOVE, so
+ * loop() keeps handling messages while the bot moves.
+ **/
+void motion_start(move_program_t program, const motion_time_t *steps, uint8_t length)
+{
+    uint8_t s;
+
+    for (s = 0; s < length; s++)
+        mydata->move_motion[s] = steps[s];
+    mydata->move_program = program;
+    mydata->move_length = length;
+    mydata->move_state = 0;
+    set_motion(steps[0].motion);
+    timer_set(TIMER_MOVE, steps[0].time * MOTION_STEP);
+}
+
+void motion_stop()
+{
+    mydata->move_length = 0;
+    timer_cancel(TIMER_MOVE);
+    set_motion(STOP);
+}
+
+// Moves the running program on to its next step once the current one is over
+void motion_run()
+{
+    if (!mydata->move_length || !timer_due(TIMER_MOVE))
+        return;
+    if (++mydata->move_state == mydata->move_length)
+    {
+        motion_stop();
+        return;
+    }
+    set_motion(mydata->move_motion[mydata->move_state].motion);
+    timer_set(TIMER_MOVE, mydata->move_motion[mydata->move_state].time * MOTION_STEP);
+}
+
+static const motion_time_t token_dance[] = { { LEFT, 3 }, { RIGHT, 5 }, { LEFT, 2 } };
+
+/**
+ * The token holder's turn: it dances token_dance, then passes the token on.
+ **/
+void move()
+{
+    if (mydata->state != COOPERATIVE || !mydata->token || mydata->my_right == mydata->my_id)
+        return;
+    if (mydata->move_program != MOVE_DANCE)
+    {
+        mydata->green = 1;
+        motion_start(MOVE_DANCE, token_dance, sizeof(token_dance) / sizeof(token_dance[0]));
+    }
+    else if (!mydata->move_length)
     {
         mydata->green = 0;
-        set_motion(STOP);
+        mydata->move_program = MOVE_IDLE;
+        send_move();
     }
 }
 
 
+/**
+ * Adopts the leader announced in payload if its election is newer than the one we decided on.
+ * Every message carries LEADER and EPOCH, so a bot that missed the ELECT flood still learns the leader.
+ * The kilobot with uid 0 never follows: after reset_data() it calls a newer election itself
+ * (see select_leader()) rather than take its own old one back from a neighbor.
+ * Returns 1 if the leader was adopted.
+ **/
+char adopt_leader(uint8_t *payload)
+{
+    if (get_field(payload, EPOCH) == 0 || kilo_uid == 0)
+        return 0;       // sender is undecided, or this is the leader's own election coming back
+    if (mydata->has_decided && (int8_t)(get_field(payload, EPOCH) - mydata->election_epoch) <= 0)
+        return 0;       // already have this election or a newer one
+
+    mydata->is_leader = 0;
+    mydata->has_decided = 1;
+    //turn robot blue if it has received message about its leader
+    mydata->red = 0;
+    mydata->green = 0;
+    mydata->blue = 255;
+
+    mydata->leader_id = get_field(payload, LEADER);
+    mydata->election_epoch = get_field(payload, EPOCH);
+    mydata->token_resync = 1;
+    return 1;
+}
+
+
+/**
+ * Forwards an ELECT once per election: on first receipt, or when its epoch is newer.
+ **/
 void recv_elect(uint8_t *payload)
 {
-    printf("My ID is: %d, I received a message from ID: %d with intended recv ID: %d\n", mydata->my_id, payload[SENDER], payload[RECEIVER]);
-    if(mydata->my_id == payload[LEADER]){
-        //do nothing
-    }
-    else{
-        //if current robot has not received msg about its leader
-        if(!(mydata->has_decided)){
-            //printf("ID: %d rcved msg from ID: %d\n", payload[RECEIVER], payload[SENDER]);
-            mydata->is_leader = 0;
-            mydata->has_decided = 1;
-            //turn robot blue if it has received message about its leader
-            mydata->red = 0;
-            mydata->green = 0;
-            mydata->blue = 255;
-        
-            mydata->leader_id = payload[LEADER];
-        }
-        if (!enqueue_message(ELECT))
-        {
-            mydata->queue_elect = 1;
-        }
-        else {
-#ifdef SIMULATOR
-            //printf("PASS_ELECT - id: %d, right: %d, left: %d, state: %d, leadid: %d, islead: %d, hasdecided: %d\n", mydata->my_id, mydata->my_right, mydata->my_left, mydata->state, mydata->leader_id, mydata->is_leader, mydata->has_decided);
-#endif
-        }
-    }
+    if (adopt_leader(payload))
+        enqueue_message(ELECT);
 }
 
 
@@ -478,29 +1125,18 @@ void recv_elect(uint8_t *payload)
  **/
 char check_message_received()
 {
-    uint8_t i;
-
-    for(i = 0; i < mydata->num_neighbors; i++)
-    {
-        if (mydata->nearest_neighbors[i].message_received == 0)     // Found a neighbor that's missing a message.
-        {
-            /*#ifdef SIMULATOR
-                printf("Missing message (ID): %d\n", mydata->nearest_neighbors[i].id);  // Debugging text
-            #endif*/
-            return 0;
-        }
-    }
-    return 1;
+    return mydata->num_received == mydata->num_neighbors;
 }
 
 /**
- * Resets the loop counter and message received tracker on each neighbor.
+ * Restarts the MESSAGE_TIMEOUT window and the message received tracker on each neighbor.
  **/
 void reset_receive_checker()
 {
     uint8_t i;
 
-    mydata->loop_counter = 0;
+    timer_set(TIMER_CHECK, MESSAGE_TIMEOUT);
+    mydata->num_received = 0;
     for(i = 0; i < mydata->num_neighbors; i++)
     {
         mydata->nearest_neighbors[i].message_received = 0;
@@ -512,52 +1148,166 @@ void reset_receive_checker()
  **/
 void reset_data()
 {
+#ifdef STATS
+    mydata->stats.resets++;
+    sweep_event("RESET");
+#endif
     mydata->state = AUTONOMOUS;
     mydata->my_left = mydata->my_right = mydata->my_id;
     mydata->num_neighbors = 0;
-    mydata->time_active = 0;
+    mydata->num_stable = 0;
+    mydata->num_received = 0;
+    mydata->num_cooperative_neighbors = 0;
+    clear_neighbor_index();
+    mydata->join_choice = 0;
+    motion_stop();
+    mydata->move_program = MOVE_IDLE;
+    mydata->approach_last = 0;
+    mydata->approach_target = 0;
+    mydata->approach_fresh = 0;
     mydata->red = 0;
     mydata->green = 0;
     mydata->blue = 0;
     mydata->color_id = mydata->my_id;
-    mydata->loop_counter = 0;
     mydata->round_counter = 0;
     mydata->shift_down_counter = 0;
-    mydata->leader_counter = 0;
     mydata->is_leader = 0;
     mydata->has_decided = 0;
     mydata->leader_id = mydata->my_id;
+    mydata->token = 0;
+    mydata->token_resync = 1;
+    timer_cancel(TIMER_TOKEN);
+}
+
+/**
+ * Random id other than 0, my_id and the ids in the neighbor table.
+ **/
+bot_id_t draw_id()
+{
+    bot_id_t id;
+
+    do
+    {
+#ifdef WIDE_IDS
+        id = rand_soft();                       // two statements: the low byte is drawn first
+        id = (id | (bot_id_t) rand_soft() << 8) & ID_MASK;
+#else
+        id = rand_soft();
+#endif
+    } while (id == 0 || id == mydata->my_id || exists_nearest_neighbor(id) < mydata->num_neighbors);
+    return id;
+}
+
+/**
+ * Another bot in range sent my_id: takes a new one and starts over, since
+ * my links, and my neighbors' links to me, may mean either bot.
+ **/
+void redraw_id()
+{
+    mydata->my_id = draw_id();
+#ifdef STATS
+    mydata->stats.ids_redrawn++;
+#endif
+#ifdef TRACE
+    {
+        uint8_t ids[9] = { mydata->my_id & 0xFF, mydata->my_id >> 8 };
+        trace_record(TRACE_REDRAW, 0, ids);
+    }
+#endif
+    reset_data();
+}
+
+/**
+ * Removes neighbor slot i, moving the last slot into its place.
+ * If it was one of my ring links, both links are cleared and the kilobot goes back
+ * to AUTONOMOUS, so that it joins the ring again rather than keep half a link.
+ **/
+void remove_nearest_neighbor(uint8_t i)
+{
+    bot_id_t id = mydata->nearest_neighbors[i].id;
+    uint8_t last = mydata->num_neighbors - 1;
+
+    mydata->num_stable -= is_neighbor_stable(i);
+    mydata->num_received -= mydata->nearest_neighbors[i].message_received;
+    mydata->num_cooperative_neighbors -= mydata->nearest_neighbors[i].state == COOPERATIVE;
+
+    unindex_nearest_neighbor(i);
+    if (i != last)
+    {
+        unindex_nearest_neighbor(last);
+        mydata->nearest_neighbors[i] = mydata->nearest_neighbors[last];
+        index_nearest_neighbor(i);
+    }
+    mydata->num_neighbors--;
+    rebuild_nearest();
+
+    if (mydata->my_left == id || mydata->my_right == id)
+    {
+        mydata->join_choice = mydata->my_left == id ? mydata->my_right : mydata->my_left;
+        if (mydata->join_choice == mydata->my_id || mydata->join_choice == id)
+            mydata->join_choice = 0;
+        mydata->my_left = mydata->my_right = mydata->my_id;
+        mydata->state = AUTONOMOUS;
+        mydata->token_resync = 1;
+        mydata->red = 0;
+        mydata->green = 0;
+        mydata->blue = 0;
+    }
+    share_reset();
+}
+
+/**
+ * Evicts every neighbor whose expiry has passed: LIVENESS_FACTOR of its SHARE intervals
+ * (at least MESSAGE_TIMEOUT) without hearing from it.
+ **/
+void evict_stale_neighbors()
+{
+    uint8_t i = 0;
+    while (i < mydata->num_neighbors)
+    {
+        if ((int8_t) (expiry(0) - mydata->nearest_neighbors[i].expires) >= 0)
+        {
+            remove_nearest_neighbor(i);     // slot i now holds the former last slot, check it next
+#ifdef STATS
+            mydata->stats.evictions++;
+#endif
+        }
+        else
+            i++;
+    }
 }
 
 /**
  * Checks to see if messages have been recieved by all neighbors.
- * Resets the node if the threshold is hit for the loop counter.
+ * Neighbors still missing when TIMER_CHECK expires are evicted; the whole node is only reset once it has none left.
  **/
 void check_messages()
 {
     /*#ifdef SIMULATOR
-        printf("Message received: %i, Loop Counter: %d, Now: %d\n", check_message_received(), mydata->loop_counter, mydata->now);     // Debugging text.
+        printf("Message received: %i, Now: %d\n", check_message_received(), mydata->now);     // Debugging text.
     #endif*/
     if (mydata->num_neighbors == 0)
     {
-        // Do nothing
+        timer_cancel(TIMER_CHECK);          // Nobody to wait for, the first message restarts the window
     }
     else if (check_message_received())      // A message from each neighbor has been received.
     {
         reset_receive_checker();
     }
-    else if (mydata->loop_counter >= 50)    // Some neighbors are missing and loop timeout is reached
+    else if (timer_due(TIMER_CHECK))        // Some neighbors are missing and the timeout is reached
     {
-        reset_data();
+        evict_stale_neighbors();
+        if (mydata->num_neighbors == 0)
+            reset_data();
         reset_receive_checker();
     }
-    else                                    // Some neighbors are missing but we haven't reached loop timeout.
-        mydata->loop_counter++;
+    // else some neighbors are missing but we haven't reached the timeout.
 }
 
 
 /**
- * Ensures that my nearest (in distance) neighbors are my left and right.
+ * Ensures that my nearest (in distance) neighbors are my left and right,
+ * and that my links run the same way round as my neighbors' links.
 */
 
 void set_closest_neighbors() 
@@ -566,34 +1316,42 @@ void set_closest_neighbors()
     {
         mydata->my_left = mydata->nearest_neighbors[0].id;
         mydata->my_right = mydata->nearest_neighbors[0].id;
+        mydata->join_choice = mydata->my_left;
         if (mydata->state == AUTONOMOUS)
             mydata->state = COOPERATIVE;
     }
 
     else if ((mydata->num_neighbors >= 2) && mydata->my_right == mydata->my_left)
     {
-        uint8_t i = 0;
-        uint8_t closest_neighbor = 0, second_closest = 0;
-        uint16_t min_dist = 1000;
-        while (i < mydata->num_neighbors)
-        {
-            if (mydata->nearest_neighbors[i].distance < min_dist)
-            {
-                second_closest = closest_neighbor;
-                min_dist = mydata->nearest_neighbors[i].distance;
-                closest_neighbor = i;
-            }
-            else if (mydata->nearest_neighbors[i].distance < min_dist && i != closest_neighbor)
-            {
-                second_closest = i;
-            }
-            ++i;
-        }
-        mydata->my_left = mydata->nearest_neighbors[closest_neighbor].id;
-        mydata->my_right = mydata->nearest_neighbors[second_closest].id;
+        uint8_t right = mydata->nearest[1];
+        uint8_t k = exists_nearest_neighbor(mydata->join_choice);
+
+        // Hysteresis: a link I already had stays unless two neighbors are clearly closer
+        if (k < mydata->num_neighbors && k != mydata->nearest[0] && k != right &&
+            filtered_distance(k) <= filtered_distance(right) + (LINK_HYSTERESIS << DISTANCE_SHIFT))
+            right = k;
+        mydata->my_left = mydata->nearest_neighbors[mydata->nearest[0]].id;
+        mydata->my_right = mydata->nearest_neighbors[right].id;
         if (mydata->state == AUTONOMOUS)
             mydata->state = COOPERATIVE;
     }
+    else if (mydata->state == COOPERATIVE && mydata->my_right != mydata->my_left)
+    {
+        uint8_t r = exists_nearest_neighbor(mydata->my_right);
+        uint8_t l = exists_nearest_neighbor(mydata->my_left);
+
+        // My right has me as its right and my left has me as its left: I run the
+        // ring the other way round from both of them, so I turn around. Waiting
+        // for both keeps bots in a patch with no consistent direction from flapping.
+        if (r < mydata->num_neighbors && mydata->nearest_neighbors[r].right_id == mydata->my_id &&
+            l < mydata->num_neighbors && mydata->nearest_neighbors[l].left_id == mydata->my_id)
+        {
+            bot_id_t right = mydata->my_right;
+
+            mydata->my_right = mydata->my_left;
+            mydata->my_left = right;
+        }
+    }
 
 /*#ifdef SIMULATOR
             printf("Sending Joining %d right=%d left=%d\n", mydata->my_id, mydata->my_right, mydata->my_left);
@@ -601,136 +1359,336 @@ void set_closest_neighbors()
 #endif*/
 }
 
+static const motion_time_t approach_step[] = { { FORWARD, 2 } };
+
+/**
+ * Contracts the ring toward the leader, by filtered distance alone: a bot that
+ * hears the leader closes in on it, the others on their my_left, until
+ * APPROACH_DISTANCE. It steps forward while that brings it closer and turns
+ * by a random angle when a step did not, then tries the new heading. Every
+ * decision waits for a fresh sample of the target, since neighbors may SHARE
+ * only every SHARING_TIME_MAX ticks.
+ **/
 void move_towards_leader(){
-    if(mydata->state == COOPERATIVE && mydata->has_decided == 1){
-        
+    uint8_t i;
+    bot_id_t target;
+
+    if (mydata->state != COOPERATIVE || !mydata->has_decided || mydata->is_leader ||
+        mydata->move_length || mydata->move_program == MOVE_DANCE)
+        return;
+
+    target = mydata->leader_id;
+    i = exists_nearest_neighbor(target);
+    if (i >= mydata->num_neighbors)
+    {
+        target = mydata->my_left;
+        i = exists_nearest_neighbor(target);
+    }
+    if (target != mydata->approach_target)
+    {
+        mydata->approach_target = target;
+        mydata->approach_fresh = 0;
+        mydata->approach_last = 0;
+    }
+    if (i >= mydata->num_neighbors || mydata->nearest_neighbors[i].distance <= APPROACH_DISTANCE)
+    {
+        mydata->approach_last = 0;
+        mydata->move_program = MOVE_IDLE;
+        return;
     }
+    if (!mydata->approach_fresh)
+        return;
+    mydata->approach_fresh = 0;
+
+    if (mydata->approach_last && mydata->nearest_neighbors[i].distance >= mydata->approach_last)
+    {
+        motion_time_t turn = { LEFT, APPROACH_TURN_MIN + rand_soft() % APPROACH_TURN_SPAN };
+
+        motion_start(MOVE_APPROACH, &turn, 1);
+        mydata->approach_last = 0;      // the next step tries the new heading
+    }
+    else
+    {
+        motion_start(MOVE_APPROACH, approach_step, sizeof(approach_step) / sizeof(approach_step[0]));
+        mydata->approach_last = mydata->nearest_neighbors[i].distance;
+    }
+}
+
+/**
+ * One Cole-Vishkin step: twice the index of the lowest bit in which color
+ * differs from next, plus that bit of color. Along a properly colored ring
+ * the result is proper again, and b-bit colors become colors below 2b.
+ * Equal colors (no successor) compare as if they differed in bit 0.
+ **/
+uint8_t cole_vishkin(bot_id_t color, bot_id_t next)
+{
+    bot_id_t diff = color ^ next;
+    uint8_t k = 0;
+
+    if (!diff)
+        diff = 1;
+    while (!(diff & 1))
+    {
+        diff >>= 1;
+        k++;
+    }
+    return 2 * k + (color >> k & 1);
+}
+
+// COLOR of ring neighbor id, 0 if it has not shared one yet; a missing neighbor is done with COLOR_NONE
+uint8_t ring_color(bot_id_t id)
+{
+    uint8_t i;
+
+    if (id == mydata->my_id)
+        return COLOR_DONE << 4 | COLOR_NONE;
+    i = exists_nearest_neighbor(id);
+    return i < mydata->num_neighbors ? mydata->nearest_neighbors[i].color_id : 0;
+}
+
+// Does this bot change color on a clash with ring neighbor id? See perform_coloring_algorithm().
+char gives_way(bot_id_t id)
+{
+    uint8_t i = exists_nearest_neighbor(id);
+
+    return mydata->my_id < id || (mydata->nearest_neighbors[i].left_id != mydata->my_id &&
+                                  mydata->nearest_neighbors[i].right_id != mydata->my_id);
+}
+
+// Lowest color that neither ring neighbor has
+uint8_t free_color(uint8_t left, uint8_t right)
+{
+    uint8_t color = 0;
+    while (color == left || color == right)
+        color++;
+    return color;
 }
 
-void check_elect_queue()
+/**
+ * Deterministic 3-coloring of the ring, in O(log* n) SHARE rounds.
+ * The two Cole-Vishkin steps from the ids need the ids of my_right and of
+ * its right only, which SHARE already carries, so they take no round and
+ * leave colors below CV_COLORS. Then round r removes color COLOR_DONE + NUM_COLORS - 1 - r:
+ * once both ring neighbors have reached round r, a bot with that color takes
+ * the lowest color neither neighbor has. Bots with the same color are never
+ * adjacent, so they can all do this at once, and a neighbor that is a round
+ * ahead has not changed the colors that matter. The LED shows the final color.
+ **/
+void perform_coloring_algorithm()
 {
-    if (mydata->queue_elect) {
-        if (enqueue_message(ELECT))
+    uint8_t left, right, removed, i;
+
+    if (mydata->state != COOPERATIVE)
+        return;
+
+    if (!mydata->round_counter)
+    {
+        bot_id_t right_of_right = mydata->my_right;
+
+        if (mydata->my_right != mydata->my_id)
         {
-            mydata->queue_elect = 0;
-            #ifdef SIMULATOR
-            printf("PASS_ELECT - id: %d, right: %d, left: %d, state: %d, leadid: %d, islead: %d, hasdecided: %d\n", mydata->my_id, mydata->my_right, mydata->my_left, mydata->state, mydata->leader_id, mydata->is_leader, mydata->has_decided);
-            #endif
+            i = exists_nearest_neighbor(mydata->my_right);
+            if (i >= mydata->num_neighbors)
+                return;
+            right_of_right = mydata->nearest_neighbors[i].right_id;
         }
+        mydata->color_id = cole_vishkin(cole_vishkin(mydata->my_id, mydata->my_right),
+                                        cole_vishkin(mydata->my_right, right_of_right));
+        mydata->round_counter = COLOR_START;
+        share_reset();
+        return;
+    }
+
+    left = ring_color(mydata->my_left);
+    right = ring_color(mydata->my_right);
+    if ((left >> 4) < mydata->round_counter || (right >> 4) < mydata->round_counter)
+        return;         // wait for both neighbors
+    left &= 0x0F;
+    right &= 0x0F;
+
+    if (mydata->round_counter < COLOR_DONE)
+    {
+        removed = COLOR_DONE + NUM_COLORS - 1 - mydata->round_counter;
+        if (mydata->color_id == removed)
+            mydata->color_id = free_color(left, right);
+        mydata->round_counter++;
+        share_reset();
+        if (mydata->round_counter < COLOR_DONE)
+            return;
+    }
+    // A bot that started over next to finished ones, or a neighbor that does
+    // not link back, can clash; the lower id gives way, or the one not linked back to
+    else if ((mydata->color_id == left && gives_way(mydata->my_left)) ||
+             (mydata->color_id == right && gives_way(mydata->my_right)))
+    {
+        mydata->color_id = free_color(left, right);
+        share_reset();
     }
+    else
+        return;
+
+    mydata->red = mydata->color_id == 0 ? 255 : 0;
+    mydata->green = mydata->color_id == 1 ? 255 : 0;
+    mydata->blue = mydata->color_id == 2 ? 255 : 0;
 }
 
+/**
+ * The kilobot with uid 0 starts a new election epoch whenever it is undecided.
+ **/
 void select_leader(){
     
-    if(kilo_uid == 0){
-        enqueue_message(ELECT);
+    if(kilo_uid == 0 && !mydata->has_decided){
+        if (++mydata->election_epoch == 0)
+            mydata->election_epoch = 1;     // 0 means undecided on the air
+        mydata->is_leader = 1;
         mydata->has_decided = 1;
+        mydata->leader_id = mydata->my_id;
         mydata->red = 0;
         mydata->green = 255;
         mydata->blue = 0;
+        enqueue_message(ELECT);
     }
 
 }
 /**
  * Modified loop which accounts for messages received.
- * If at least one message from each neighbor is not received in the 50 loop cycles, then this kilobot is reset.
+ * Neighbors that stop sharing are evicted, see check_messages().
  * Performs the 6 color id reduction and sets nodes to new colors.
+ * Handles the messages message_rx() queued first, then returns straight
+ * away unless one arrived or a timer expired.
  **/
 void loop()
 {
-    select_leader();
+    mydata->now = kilo_ticks;
+    drain_rx_ring();
+    trace_record(TRACE_LOOP, 0, 0);
+    stage_message();
+    if (!mydata->rx_pending && !timers_expired())
+        return;
+    mydata->rx_pending = 0;
 
-    delay(30);
+    if (timer_due(TIMER_MOTOR))
+        set_motors(mydata->motor_ccw, mydata->motor_cw);
+
+    select_leader();
 
-    check_elect_queue();    // If for some reason message queue was full, make sending the elect top priority
-    
     //print_state();                          // Debugging text.
     
     //perform_leader_election();
-    //send_move();
     send_joining();
     send_sharing();
-    //move(mydata->now);
+    check_token();
+    motion_run();
+    move();
+    move_towards_leader();
 
     check_messages();
     set_closest_neighbors();    
-    //perform_coloring_algorithm();
+    if (mydata->my_left != mydata->trickle_left || mydata->my_right != mydata->trickle_right)
+    {
+        share_reset();      // Ring links changed, tell the neighbors soon
+        mydata->round_counter = 0;      // and color again
+        mydata->trickle_left = mydata->my_left;
+        mydata->trickle_right = mydata->my_right;
+    }
+    perform_coloring_algorithm();
     //perform_clockwise_leader_election();      // SRSLY WTF WHY DOESNT IT WORK WHEN ITS HERE??? FK THE MESSAGE QUEUE POS
     
     set_color(RGB(mydata->red, mydata->green, mydata->blue));
-    mydata->now++;
+    stage_message();
+#ifdef STATS
+    stats_loop();
+#endif
 }
 
+/**
+ * Hands out the staged message, nothing if the outbox is empty.
+ **/
 message_t *message_tx()
 {
-    
-    if (mydata->tail != mydata->head)   // Queue is not empty
-    {
-        return &mydata->message[mydata->head];
-    }
-    return &mydata->nullmessage;
+    if (mydata->tx_slot < OUTBOX_SLOTS)
+        return &mydata->tx_message;
+    return 0;
 }
  
 void message_tx_success() {
-    if (mydata->tail != mydata->head) {  // Queue is not empty
-        if (mydata->copies == 2)
-        {
-            mydata->head++;
-            mydata->copies = 0;
-            mydata->head = mydata->head % QUEUE;
-        }   
-        else
-        {
-            mydata->copies++;
-        }
+    trace_record(TRACE_TX_SUCCESS, 0, mydata->tx_message.data);
+    if (mydata->tx_slot < OUTBOX_SLOTS)
+    {
+#ifdef STATS
+        mydata->stats.tx[get_field(mydata->tx_message.data, MSG)]++;
+#endif
+        if (--mydata->repeats[mydata->tx_slot] == 0)
+            mydata->tx_slot = OUTBOX_SLOTS;     // loop() stages the next one
     }
 }
 
 void setup() {
+    uint8_t slot;
     rand_seed(rand_hard());
         mydata->shift_down_counter++;
-    mydata->my_id = rand_soft();
+    mydata->num_neighbors = 0;
+    clear_neighbor_index();
+    mydata->my_id = 0;
+#ifdef WIDE_IDS
+    mydata->my_id = kilo_uid & ID_MASK;     // distinct in swarms of up to ID_MASK bots
+#endif
+    if (!mydata->my_id)
+        mydata->my_id = draw_id();
     
     mydata->state = AUTONOMOUS;
     mydata->my_left = mydata->my_right = mydata->my_id;
-    mydata->num_neighbors = 0;
-    mydata->message_sent = 0,
-    mydata->now = 0,
-    mydata->nextShareSending = SHARING_TIME,
-    mydata->cur_motion = STOP;
+    mydata->num_stable = 0;
+    mydata->num_received = 0;
+    mydata->num_cooperative_neighbors = 0;
+    mydata->now = kilo_ticks;
+    mydata->timers_armed = 0;
+    mydata->rx_pending = 0;
+    mydata->rx_head = mydata->rx_tail = 0;
+    mydata->share_interval = SHARING_TIME;
+    timer_set(TIMER_SHARE, SHARING_TIME);
     mydata->motion_state = STOP;
-    mydata->time_active = 0;
+    mydata->move_program = MOVE_IDLE;
     mydata->move_state = 0;
-    mydata->move_motion[0].motion = LEFT;
-    mydata->move_motion[0].motion = 3;
-    mydata->move_motion[1].motion = RIGHT;
-    mydata->move_motion[1].motion = 5;
-    mydata->move_motion[0].motion = LEFT;
-    mydata->move_motion[0].motion = 2;
+    mydata->move_length = 0;
+    mydata->approach_last = 0;
+    mydata->approach_target = 0;
+    mydata->approach_fresh = 0;
     mydata->red = 0,
     mydata->green = 0,
-    mydata->blue = 0,
-    mydata->send_token = 0;
+    mydata->blue = 0;
 
-    mydata->nullmessage.data[MSG] = NULL_MSG;
-    mydata->nullmessage.crc = message_crc(&mydata->nullmessage);
-    
-    mydata->token = rand_soft() < 128  ? 1 : 0;
-    mydata->blue = mydata->token;
-    mydata->head = 0;
-    mydata->tail = 0;
-    mydata->copies = 0;
+    mydata->token = 0;                  // the leader creates it, see check_token()
+    mydata->token_round = 0;
+    mydata->token_resync = 1;
+    mydata->token_sent = 0;
+    mydata->token_timeout = TOKEN_LOSS_TIME;
+    mydata->token_rtt = 0;
+    for (slot = 0; slot < OUTBOX_SLOTS; slot++)
+        mydata->repeats[slot] = 0;
+    mydata->tx_slot = OUTBOX_SLOTS;
+    mydata->share_count = 0;
+    mydata->digest_next = 0;
+    mydata->trickle_left = mydata->my_left;
+    mydata->trickle_right = mydata->my_right;
+    mydata->join_choice = 0;
 
-    mydata->loop_counter = 0;
     mydata->round_counter = 0;
     mydata->color_id = mydata->my_id;
-    mydata->leader_counter = 0;
     mydata->is_leader = 0;
     mydata->has_decided = 0;
+    mydata->leader_id = mydata->my_id;
+    mydata->election_epoch = 0;
    
-#ifdef SIMULATOR
+#ifdef STATS
+    mydata->stats = (stats_t) { .last_state = mydata->state, .last_decided = mydata->has_decided };
+#endif
+#ifdef TRACE
+    {
+        uint8_t ids[9] = { mydata->my_id & 0xFF, mydata->my_id >> 8 };
+        trace_record(TRACE_SETUP, 0, ids);
+    }
 #endif
-    mydata->message_sent = 1;
 }
 
 #ifdef SIMULATOR
@@ -738,15 +1696,71 @@ void setup() {
 static char botinfo_buffer[10000];
 char *cb_botinfo(void)
 {
+    uint8_t t;
     char *p = botinfo_buffer;
     p += sprintf (p, "ID: %d \n", kilo_uid);
     if (mydata->state == COOPERATIVE)
         p += sprintf (p, "State: COOPERATIVE\n");
     if (mydata->state == AUTONOMOUS)
         p += sprintf (p, "State: AUTONOMOUS\n");
-    
+    p += sprintf (p, "my_id: %d, left: %d, right: %d, leader: %d, neighbors: %d\n",
+                  mydata->my_id, mydata->my_left, mydata->my_right, mydata->leader_id, mydata->num_neighbors);
+
+    p += sprintf (p, "rx/tx:");
+    for (t = SHARE; t < NUM_MSG_TYPES; t++)
+        p += sprintf (p, " %s %lu/%lu", message_names[t],
+                      (unsigned long) mydata->stats.rx[t], (unsigned long) mydata->stats.tx[t]);
+    p += sprintf (p, "\noverwritten: %lu, evictions: %lu, resets: %lu, ids redrawn: %lu, rx dropped: %lu\n",
+                  (unsigned long) mydata->stats.overwritten, (unsigned long) mydata->stats.evictions,
+                  (unsigned long) mydata->stats.resets, (unsigned long) mydata->stats.ids_redrawn,
+                  (unsigned long) mydata->stats.rx_dropped);
+    p += sprintf (p, "cooperative at: %lu, decided at: %lu\n",
+                  (unsigned long) mydata->stats.coop_tick, (unsigned long) mydata->stats.decided_tick);
+    p += sprintf (p, "token: %s, round %d, rtt %u, dropped %lu, regenerated %lu\n", mydata->token ? "held" : "-",
+                  mydata->token_round, mydata->token_rtt, (unsigned long) mydata->stats.tokens_dropped,
+                  (unsigned long) mydata->stats.tokens_regenerated);
+
     return botinfo_buffer;
 }
+
+#ifndef HOST
+/* per bot state for the kilombo state file (stateFileName) */
+json_t *json_state()
+{
+    uint8_t t;
+    json_t *state = json_object();
+    json_t *rx = json_object();
+    json_t *tx = json_object();
+
+    json_object_set_new(state, "my_id", json_integer(mydata->my_id));
+    json_object_set_new(state, "state", json_integer(mydata->state));
+    json_object_set_new(state, "my_left", json_integer(mydata->my_left));
+    json_object_set_new(state, "my_right", json_integer(mydata->my_right));
+    json_object_set_new(state, "leader_id", json_integer(mydata->leader_id));
+    json_object_set_new(state, "has_decided", json_integer(mydata->has_decided));
+    json_object_set_new(state, "num_neighbors", json_integer(mydata->num_neighbors));
+
+    for (t = SHARE; t < NUM_MSG_TYPES; t++)
+    {
+        json_object_set_new(rx, message_names[t], json_integer(mydata->stats.rx[t]));
+        json_object_set_new(tx, message_names[t], json_integer(mydata->stats.tx[t]));
+    }
+    json_object_set_new(state, "rx", rx);
+    json_object_set_new(state, "tx", tx);
+    json_object_set_new(state, "overwritten", json_integer(mydata->stats.overwritten));
+    json_object_set_new(state, "evictions", json_integer(mydata->stats.evictions));
+    json_object_set_new(state, "resets", json_integer(mydata->stats.resets));
+    json_object_set_new(state, "ids_redrawn", json_integer(mydata->stats.ids_redrawn));
+    json_object_set_new(state, "rx_dropped", json_integer(mydata->stats.rx_dropped));
+    json_object_set_new(state, "coop_tick", json_integer(mydata->stats.coop_tick));
+    json_object_set_new(state, "decided_tick", json_integer(mydata->stats.decided_tick));
+    json_object_set_new(state, "token_rtt", json_integer(mydata->token_rtt));
+    json_object_set_new(state, "tokens_dropped", json_integer(mydata->stats.tokens_dropped));
+    json_object_set_new(state, "tokens_regenerated", json_integer(mydata->stats.tokens_regenerated));
+
+    return state;
+}
+#endif
 #endif
 
 void main() {
@@ -754,5 +1768,11 @@ void main() {
     kilo_message_tx = message_tx;
     kilo_message_tx_success = message_tx_success;
     kilo_message_rx = message_rx;
+#ifdef SIMULATOR
+    SET_CALLBACK(botinfo, cb_botinfo);
+#ifndef HOST
+    SET_CALLBACK(json_state, json_state);
+#endif
+#endif
     kilo_start(setup, loop);
 }
@@ -1,11 +1,63 @@
 
 
-#define MAX_NUM_NEIGHBORS 10
-#define SHARING_TIME 10
-#define TOKEN_TIME 103
+#define MAX_NUM_NEIGHBORS 20
+#define NEIGHBOR_INDEX_SIZE 32  // id -> slot hash, power of two, at most 2/3 full
 
+#if (NEIGHBOR_INDEX_SIZE & (NEIGHBOR_INDEX_SIZE - 1)) || 2 * NEIGHBOR_INDEX_SIZE < 3 * MAX_NUM_NEIGHBORS
+#error "NEIGHBOR_INDEX_SIZE must be a power of two and at least 1.5 * MAX_NUM_NEIGHBORS"
+#endif
+#define NEAREST_K 2             // nearest neighbors kept sorted in USERDATA.nearest
+
+#if NEAREST_K < 2 || NEAREST_K > MAX_NUM_NEIGHBORS
+#error "NEAREST_K must be between 2 and MAX_NUM_NEIGHBORS"
+#endif
+#define SHARING_TIME 10         // shortest SHARE interval, Trickle style back-off doubles it...
+#define SHARING_TIME_MAX 64     // ...up to this while nothing changes around the bot
+#define LIVENESS_FACTOR 3       // a neighbor is evicted after LIVENESS_FACTOR of its SHARE intervals
+#define EXPIRE_SHIFT 2          // nearest_neighbor_t.expires counts kilo_ticks >> EXPIRE_SHIFT
+#define TOKEN_LOSS_TIME 4096    // ticks the leader first waits for its token to come back
+#define TOKEN_LOSS_MAX 30000    // longest wait, timer deadlines compare within 32767 ticks
+#define MESSAGE_TIMEOUT 50      // shortest time without hearing from a neighbor before it is evicted
+#define STREAK_MAX 63           // nearest_neighbor_t.streak saturates here
+#define DISTANCE_SHIFT 4        // fraction bits of the filtered neighbor distance
+#define DISTANCE_EWMA 2         // each sample moves it 1/2^DISTANCE_EWMA of the way
+#define LINK_HYSTERESIS 4       // mm a new link candidate must beat the link it replaces by
+#define MOTION_STEP 16          // ticks per motion_time_t.time unit
+#define MOVE_PROGRAM_MAX 3      // steps in a motion program
+#define APPROACH_DISTANCE 45    // mm, move_towards_leader() stops this close to its target
+#define APPROACH_TURN_MIN 4     // motion_time_t.time of the turn after a step that did not get closer...
+#define APPROACH_TURN_SPAN 12   // ...plus up to this much more, at random
+#define SPINUP_TIME 1           // ticks at full power before a motor gets its real speed
+#define COLOR_START 2           // round_counter after the two Cole-Vishkin steps, colors are then below CV_COLORS...
+#define NUM_COLORS 3            // ...and each further round removes the highest until this many are left
+#define COLOR_DONE (COLOR_START + CV_COLORS - NUM_COLORS)
+#define COLOR_NONE 0x0F         // color of a missing ring neighbor
+
+// TIMERS: deadlines in kilo_ticks, see timer_set()/timer_due()
+#define TIMER_SHARE 0
+#define TIMER_CHECK 1
+#define TIMER_TOKEN 2           // leader only: the token it sent is lost
+#define TIMER_MOTOR 3
+#define TIMER_MOVE 4            // end of the current step of the motion program
+#define NUM_TIMERS 5
 
-//PAYLOAD
+
+// IDS: my_id is a random byte, or with -DWIDE_IDS kilo_uid cut to ID_BITS, for
+// swarms beyond 256 bots. Either way a bot that hears its own id draws a new one.
+#ifdef WIDE_IDS
+#define ID_BITS 12
+#define ID_DRAWS 2              // rand_soft() calls per draw_id() try, low byte first
+typedef uint16_t bot_id_t;
+#else
+#define ID_BITS 8
+#define ID_DRAWS 1
+typedef uint8_t bot_id_t;
+#endif
+#define ID_MASK ((1 << ID_BITS) - 1)  // id 0 is never used
+#define CV_COLORS (ID_BITS > 8 ? 10 : 8)    // colors after two Cole-Vishkin steps from ID_BITS (up to 16) bits
+
+//PAYLOAD: read and written through get_field()/put_field()
+#ifndef WIDE_IDS
 #define MSG 0
 #define ID 1
 #define RIGHT_ID  2
@@ -13,14 +65,79 @@
 #define STATE  4
 
 #define RECEIVER 5
-#define SENDER 6
+#define SHARE_INTERVAL 5    // SHARE only: sender's current SHARE interval in SHARE_INTERVAL_UNIT ticks
+#define SHARE_INTERVAL_UNIT 1
+#define EPOCH 6     // election epoch of LEADER, 0 if undecided (used to be SENDER, a copy of ID)
 
-#define COLOR 7
+#define COLOR 7             // round_counter << 4 | color_id, 0 before the bot starts coloring
+#define TOKEN_ROUND 7       // MOVE only: round of the token, counted by the leader
 #define LEADER 8
 
-#define ACTIVE 0
+// DIGEST PAYLOAD: MSG and ID as above, then DIGEST_ENTRIES of the sender's
+// neighbors, its my_right and my_left first. Distances are DIGEST_UNIT steps, a nibble each.
+#define DIGEST_IDS 2            // bytes 2-5: neighbor ids, 0 if unused
+#define DIGEST_DISTS 6          // bytes 6-7: their distances, entry 2k in the low nibble of DIGEST_DISTS + k
+#define DIGEST_ENTRIES 4
+#define DIGEST_ID(k) (DIGEST_IDS + (k))
+
+#define get_field(payload, field) ((payload)[field])
+#define put_field(payload, field, value) ((payload)[field] = (value))
+#else
+// WIDE PAYLOAD: the same fields, packed little endian at bit granularity.
+// A field is FIELD(bit offset, width in bits).
+#define FIELD(offset, width) ((offset) << 4 | (width))
+#define MSG FIELD(0, 3)
+#define STATE FIELD(3, 1)
+#define SHARE_INTERVAL FIELD(4, 4)
+#define SHARE_INTERVAL_UNIT 8       // rounded up, so SHARING_TIME_MAX must stay below 16 units
+#define ID FIELD(8, 12)
+#define RIGHT_ID FIELD(20, 12)
+#define RECEIVER RIGHT_ID           // JOIN and MOVE always go to the sender's my_right
+#define LEFT_ID FIELD(32, 12)
+#define LEADER FIELD(44, 12)
+#define EPOCH FIELD(56, 8)
+#define COLOR FIELD(64, 8)
+#define TOKEN_ROUND COLOR
+
+// DIGEST: ids at bits 20-55, the distance nibbles at 56-67
+#define DIGEST_ENTRIES 3
+#define DIGEST_ID(k) FIELD(20 + ID_BITS * (k), ID_BITS)
+#define DIGEST_DIST(k) FIELD(56 + 4 * (k), 4)
+
+#if (SHARING_TIME_MAX + SHARE_INTERVAL_UNIT - 1) / SHARE_INTERVAL_UNIT > 15
+#error "SHARING_TIME_MAX does not fit the 4-bit SHARE_INTERVAL of the wide payload"
+#endif
+#endif
+#define DIGEST_UNIT 6
+#define DIGEST_PERIOD 2         // a cooperative bot sends a DIGEST with every DIGEST_PERIOD-th SHARE
+
+// OUTBOX: one slot per message type, listed in transmit priority order.
+// A new message replaces a pending one of the same type.
+#define OUTBOX_JOIN 0
+#define OUTBOX_ELECT 1
+#define OUTBOX_MOVE 2
+#define OUTBOX_SHARE 3
+#define OUTBOX_DIGEST 4
+#define OUTBOX_SLOTS 5
+
+// RX RING: messages message_rx() queued for the next loop(). message_rx() runs
+// in the radio ISR on the bot and only advances rx_head, loop() only rx_tail.
+// Power of two; when full, new messages are dropped. The simulators deliver a
+// whole tick of traffic between two loop()s, the bot runs loop() between packets.
+#ifdef KILOBOT
+#define RX_RING_SIZE 8
+#else
+#define RX_RING_SIZE 16
+#endif
+// Keeps the compiler from moving the entry accesses past the index update
+#define RX_BARRIER() __asm__ __volatile__ ("" ::: "memory")
 
-#define QUEUE 3
+// Number of times each message type is transmitted
+#define JOIN_REPEATS 3
+#define ELECT_REPEATS 3
+#define MOVE_REPEATS 3
+#define SHARE_REPEATS 1         // the next periodic SHARE is the retry
+#define DIGEST_REPEATS 1
 
 
 #ifndef M_PI
@@ -32,7 +149,9 @@ typedef enum { NULL_MSG,
     JOIN,
     LEAVE,
     MOVE,
-    ELECT
+    ELECT,
+    DIGEST,
+    NUM_MSG_TYPES
 } message_type;  // MESSAGES
 
 typedef enum {
@@ -49,61 +168,139 @@ typedef enum {
     RIGHT
 } motion_t;
 
-typedef struct{
-    uint8_t id;
-    uint8_t right_id;
-    uint8_t left_id;
-    robot_state state;
-    uint8_t distance;
-    uint8_t num;
-    uint8_t num_cooperative;
+// Motion program in USERDATA.move_motion, see motion_start()
+typedef enum {
+    MOVE_IDLE,
+    MOVE_DANCE,             // move(): the token holder's turn
+    MOVE_APPROACH           // move_towards_leader()
+} move_program_t;
 
-    char message_received;              // Boolean value that keeps track of a recently received message. 0 (False), 1 (True).
-    uint8_t color_id;                   // Share color id 
+typedef struct{
+    bot_id_t id;
+    bot_id_t right_id;
+    bot_id_t left_id;
+    uint8_t distance;                   // Filtered (EWMA) distance, see filter_distance()
+    uint8_t distance_frac;              // and its low DISTANCE_SHIFT fraction bits
+    uint8_t color_id;                   // COLOR of its last message, see perform_coloring_algorithm()
+    uint8_t expires;                    // kilo_ticks >> EXPIRE_SHIFT (low byte) at which it is evicted, see evict_stale_neighbors()
+    uint8_t right_distance;             // Distance from this neighbor to its right_id, from its DIGEST; 0 if unknown
 
+    uint8_t state : 1;                  // robot_state of the last SHARE
+    uint8_t message_received : 1;       // Boolean value that keeps track of a recently received message. 0 (False), 1 (True).
+    uint8_t streak : 6;                 // SHAREs in a row with the same state, up to STREAK_MAX
 } nearest_neighbor_t;
 
+typedef struct {
+    uint8_t payload[9];
+    distance_measurement_t distance;    // as received, estimate_distance() runs in loop()
+} rx_entry_t;
+
+// expires must stay within 127 units of now: up to the longest timeout ahead, up to one check window behind
+#if (LIVENESS_FACTOR * SHARING_TIME_MAX + MESSAGE_TIMEOUT) >> EXPIRE_SHIFT > 127
+#error "Neighbor timeouts too long for the 8-bit nearest_neighbor_t.expires"
+#endif
+
 typedef struct  {
     uint8_t motion;
     uint8_t time;
 } motion_time_t;
 
+// Protocol counters, shown by cb_botinfo() and json_state(). Not in the hex build.
+#ifndef KILOBOT
+#define STATS
+#endif
+
+#ifdef STATS
+typedef struct {
+    uint32_t rx[NUM_MSG_TYPES];         // Messages received, per message_type
+    uint32_t tx[NUM_MSG_TYPES];         // Transmissions, per message_type
+    uint32_t overwritten;               // Pending messages replaced before all their repeats went out
+    uint32_t evictions;                 // Neighbors evicted for going quiet
+    uint32_t resets;                    // reset_data() calls
+    uint32_t coop_tick;                 // kilo_ticks when the bot last became COOPERATIVE, 0 if never
+    uint32_t decided_tick;              // kilo_ticks when has_decided was last set, 0 if never
+    uint32_t tokens_dropped;            // Repeated or stale MOVE tokens ignored
+    uint32_t tokens_regenerated;        // Tokens the leader gave up as lost and replaced
+    uint32_t ids_redrawn;               // my_id draws after hearing another bot with the same id
+    uint32_t rx_dropped;                // Messages dropped because the receive ring was full
+    robot_state last_state;             // state and has_decided seen by the previous stats_loop()
+    char last_decided;
+} stats_t;
+#endif
+
+// TRACE: message event log written with -DTRACE, replayed by host/replay.c.
+// One TRACE_RECORD_SIZE byte record per event: tick (4 bytes, little endian),
+// kilo_uid (2, little endian), trace_event, distance, then the 9 payload bytes.
+#define TRACE_RECORD_SIZE 17
+#define TRACE_FILE "trace.bin"          // overridden by the KILO_TRACE environment variable
+
+typedef enum {
+    TRACE_SETUP,            // after setup(): payload[0-1] my_id, little endian
+    TRACE_LOOP,             // loop() called, after the TRACE_RX of the messages it took from the ring; no payload
+    TRACE_RX,               // NORMAL message handled by loop(): distance and payload
+    TRACE_TX_SUCCESS,       // message_tx_success(): payload of the message sent
+    TRACE_REDRAW            // redraw_id(), right after the TRACE_RX that caused it: payload[0-1] the new my_id
+} trace_event;
+
 
 typedef struct
 {
-    uint8_t my_id;
-    uint8_t my_right;
-    uint8_t my_left;
-    message_t message[QUEUE];
-    message_t nullmessage;
+    bot_id_t my_id;
+    bot_id_t my_right;
+    bot_id_t my_left;
+    message_t tx_message;              // Staged copy of the highest priority pending message
+    uint8_t repeats[OUTBOX_SLOTS];     // Transmissions left for each slot, 0 when empty
+    uint8_t tx_slot;                   // Slot staged in tx_message, OUTBOX_SLOTS if none
+    uint8_t share_count;               // SHAREs since the last DIGEST
+    uint8_t share_interval;            // Current Trickle interval of TIMER_SHARE
+    bot_id_t trickle_left, trickle_right;  // Links at the last share_reset() check
+    uint8_t digest_next;               // Table slot the next DIGEST continues from
+    bot_id_t join_choice;              // Link set_closest_neighbors() prefers when it relinks, 0 if none
 
     robot_state state;
     
     uint8_t num_neighbors;
-    uint8_t message_sent;
-    uint16_t now;
-    uint16_t nextShareSending;
-    uint8_t cur_motion;
-    uint8_t motion_state;
-    uint8_t time_active;
-    uint8_t move_state;
+    uint8_t num_stable;                 // Neighbors that pass the is_stabilized() test
+    uint8_t num_received;               // Neighbors with message_received set in this window
+    uint8_t num_cooperative_neighbors;  // Neighbors last seen COOPERATIVE
+    uint16_t now;                       // kilo_ticks at the start of this loop()
+    uint16_t deadline[NUM_TIMERS];
+    uint8_t timers_armed;               // Bit per TIMER_*
+    uint8_t rx_pending;                 // A message arrived since the last loop()
+    rx_entry_t rx_ring[RX_RING_SIZE];   // Messages received since the last loop()
+    volatile uint8_t rx_head;           // Entries written by message_rx(), free running
+    volatile uint8_t rx_tail;           // Entries handled by loop(), free running
+    uint8_t motor_ccw, motor_cw;        // Speeds to set once the motor spin-up is done
+    uint8_t motion_state;               // motion_t set last
+    uint8_t move_program;               // move_program_t owning move_motion, kept once it ends
+    uint8_t move_state;                 // Step of move_motion running
+    uint8_t move_length;                // Steps in move_motion, 0 once the program ended
+    uint8_t approach_last;              // Distance to the target at the last approach step, 0 if none
+    bot_id_t approach_target;           // Neighbor move_towards_leader() closes in on
+    uint8_t approach_fresh;             // A sample of approach_target arrived since the last step
     nearest_neighbor_t nearest_neighbors[MAX_NUM_NEIGHBORS];
-    motion_time_t move_motion[3];
-    char send_token;
+    uint8_t neighbor_index[NEIGHBOR_INDEX_SIZE];   // Open-addressed id -> slot + 1 map over nearest_neighbors, 0 is empty.
+    uint8_t nearest[NEAREST_K];         // Slots of the closest neighbors by filtered distance, closest first
+    uint8_t num_nearest;                // min(num_neighbors, NEAREST_K)
+    motion_time_t move_motion[MOVE_PROGRAM_MAX];
     uint8_t green;
     uint8_t red;
     uint8_t blue;
-    int8_t token;
-    int8_t head, tail;
-    int8_t copies;
+    int8_t token;                       // Holding the MOVE token
+    uint8_t token_round;                // Newest token round accepted; the leader's current round
+    uint8_t token_resync;               // Take the next round whatever its number: I (re)joined or changed leader
+    uint16_t token_sent;                // Leader: kilo_ticks when the current round left
+    uint16_t token_timeout;             // Leader: ticks before the token counts as lost
+    uint16_t token_rtt;                 // Leader: ticks the last round took around the ring, 0 if none yet
 
-    uint8_t round_counter;
-    uint8_t loop_counter;               // Counter for the main loop. Serves as a threshold for timeout.
+    uint8_t round_counter;          // coloring round, 0 until the ring links are there, COLOR_DONE at the end
     uint8_t color_id;               // store color id of kilobot
     uint8_t shift_down_counter;     // delay shift down to happen alittle bit after coloring down algorithm.
-    uint8_t leader_counter;
     char is_leader;
     char has_decided;
-    uint8_t leader_id;
-    char queue_elect;
+    bot_id_t leader_id;
+    uint8_t election_epoch;             // Epoch of the election leader_id came from, never 0 once decided
+#ifdef STATS
+    stats_t stats;
+#endif
 } USERDATA;
@@ -0,0 +1,131 @@
+#!/bin/sh
+# Parameter sweep for line.c.
+#
+# Runs the headless simulator (make line_headless) once for every combination
+# of randSeed, nBots, formation and msgSuccessRate, spread over all cores, and
+# writes one summary row per run to $OUT:
+#
+#   seed,nbots,formation,msg_rate,ticks_all_coop,ticks_all_decided,resets,wall_s,ticks,msgs_per_bot
+#
+# ticks_all_* is the first kilo_ticks value at which every bot was COOPERATIVE
+# (resp. has_decided), or -1 if that never happened within SIMTIME. ticks and
+# msgs_per_bot (transmissions per bot) come from the final state file, which
+# carries the json_state() counters of every bot.
+# The grid is set through the environment, e.g.
+#
+#   SEEDS="1 2 3" NBOTS="10 50" FORMATIONS="random pile" RATES="0.8 1.0" ./sweep.sh
+#
+# Every run gets its own directory under $RUNDIR holding the generated
+# kilombo.json and the raw output, so a single run can be replayed by hand.
+
+SEEDS=${SEEDS:-"1 2 3 4 5 6 7 8"}
+NBOTS=${NBOTS:-"2 5 10 20"}
+FORMATIONS=${FORMATIONS:-"random line pile"}
+RATES=${RATES:-"0.8 1.0"}
+SIMTIME=${SIMTIME:-300}                 # simulated seconds per run
+JOBS=${JOBS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 4)}
+BIN=${BIN:-./line_headless}
+BASE=${BASE:-kilombo.json}
+RUNDIR=${RUNDIR:-sweep_runs}
+OUT=${OUT:-sweep.csv}
+
+# Copy of the base config with one "key" : value pair replaced.
+set_param()
+{
+    sed "s/\(\"$1\"[[:space:]]*:[[:space:]]*\)[^,]*/\1$2/"
+}
+
+# Wall-clock seconds, with sub-second resolution where date supports it.
+now()
+{
+    t=$(date +%s.%N 2>/dev/null)
+    case $t in
+        *N*|"") date +%s ;;
+        *) echo "$t" ;;
+    esac
+}
+
+# Worker: one simulator run, prints its summary row.
+run_one()
+{
+    seed=$1 nbots=$2 formation=$3 rate=$4
+    dir=$RUNDIR/s${seed}_n${nbots}_${formation}_r${rate}
+    mkdir -p "$dir"
+
+    set_param randSeed "$seed" < "$BASE" \
+        | set_param nBots "$nbots" \
+        | set_param formation "\"$formation\"" \
+        | set_param msgSuccessRate "$rate" \
+        | set_param simulationTime "$SIMTIME" \
+        | set_param GUI 0 \
+        | set_param storeHistory 0 \
+        | set_param stateFileName "\"endstate.json\"" \
+        > "$dir/kilombo.json"
+
+    # kilombo reads kilombo.json from the working directory
+    start=$(now)
+    (cd "$dir" && "$BIN_ABS" > events.log 2> stderr.log)
+    wall=$(awk -v a="$start" -v b="$(now)" 'BEGIN { printf "%.3f", b - a }')
+
+    # "ticks" and the sum of all per bot "tx" objects in the state file
+    final=$(awk -v n="$nbots" '
+        { s = s $0 }
+        END {
+            gsub(/[ \t\r\n]/, "", s)
+            ticks = match(s, /"ticks":[0-9]+/) ? substr(s, RSTART + 8, RLENGTH - 8) : -1
+            while (match(s, /"tx":\{[^}]*\}/)) {
+                m = split(substr(s, RSTART + 6, RLENGTH - 7), kv, ",")
+                for (i = 1; i <= m; i++) { split(kv[i], p, ":"); tx += p[2] }
+                s = substr(s, RSTART + RLENGTH)
+            }
+            printf "%s,%.1f", ticks, tx / n
+        }' "$dir/endstate.json" 2>/dev/null || echo "-1,-1")
+
+    awk -v n="$nbots" -v seed="$seed" -v formation="$formation" -v rate="$rate" -v wall="$wall" -v final="$final" '
+        $1 == "SWEEP" {
+            t = $2; id = $3; e = $4
+            if (e == "COOP" && !coop[id])          { coop[id] = 1; ncoop++ }
+            else if (e == "AUTO" && coop[id])      { coop[id] = 0; ncoop-- }
+            else if (e == "DECIDED" && !dec[id])   { dec[id] = 1; ndec++ }
+            else if (e == "UNDECIDED" && dec[id])  { dec[id] = 0; ndec-- }
+            else if (e == "RESET")                 resets++
+            if (ncoop == n && coop_t == "") coop_t = t
+            if (ndec == n && dec_t == "")   dec_t = t
+        }
+        END {
+            if (coop_t == "") coop_t = -1
+            if (dec_t == "")  dec_t = -1
+            printf "%s,%s,%s,%s,%s,%s,%d,%s,%s\n", seed, n, formation, rate, coop_t, dec_t, resets, wall, final
+        }' "$dir/events.log" > "$dir/summary.csv"
+    cat "$dir/summary.csv"
+}
+
+if [ "$1" = "--run" ]; then
+    shift
+    run_one "$@"
+    exit $?
+fi
+
+if [ ! -x "$BIN" ]; then
+    echo "sweep.sh: $BIN not found, build it with 'make line_headless'" >&2
+    exit 1
+fi
+
+BIN_ABS=$(cd "$(dirname "$BIN")" && pwd)/$(basename "$BIN")
+BASE=$(cd "$(dirname "$BASE")" && pwd)/$(basename "$BASE")
+export BIN_ABS BASE RUNDIR SIMTIME
+
+mkdir -p "$RUNDIR"
+echo "seed,nbots,formation,msg_rate,ticks_all_coop,ticks_all_decided,resets,wall_s,ticks,msgs_per_bot" > "$OUT"
+
+for seed in $SEEDS; do
+    for nbots in $NBOTS; do
+        for formation in $FORMATIONS; do
+            for rate in $RATES; do
+                echo "$seed $nbots $formation $rate"
+            done
+        done
+    done
+done | xargs -n 4 -P "$JOBS" "$0" --run >> "$OUT"
+
+echo "sweep.sh: $(($(wc -l < "$OUT") - 1)) runs written to $OUT"